@@ -0,0 +1,73 @@
+#pragma once
+
+#include "Common.h"
+
+// Axis aligned box in the space of CVector, used by the tree broadphases
+struct SAABB
+{
+	CVector mMin;
+	CVector mMax;
+
+	// Box of the sphere grown by its collision range (radius times KCollisionRangeScale) and by margin
+	// Two spheres can only collide if their boxes overlap
+	static SAABB OfSphere(uint32_t sphere, float margin = 0.f)
+	{
+		const auto& spheres = gSpheresCollisionInfo;
+		const auto range = spheres.mRadius[sphere] * KCollisionRangeScale + margin;
+		const auto centre = spheres.Position(sphere);
+#ifdef _3D
+		const CVector grow(range, range, range);
+#else
+		const CVector grow(range, range);
+#endif
+		return { centre - grow, centre + grow };
+	}
+
+	bool Overlaps(const SAABB& b) const
+	{
+#ifdef _3D
+		if (mMax.z < b.mMin.z || mMin.z > b.mMax.z) return false;
+#endif
+		return mMax.x >= b.mMin.x && mMin.x <= b.mMax.x && mMax.y >= b.mMin.y && mMin.y <= b.mMax.y;
+	}
+
+	bool Contains(const SAABB& b) const
+	{
+#ifdef _3D
+		if (b.mMin.z < mMin.z || b.mMax.z > mMax.z) return false;
+#endif
+		return b.mMin.x >= mMin.x && b.mMax.x <= mMax.x && b.mMin.y >= mMin.y && b.mMax.y <= mMax.y;
+	}
+
+	SAABB Union(const SAABB& b) const
+	{
+#ifdef _3D
+		return { CVector(std::min(mMin.x, b.mMin.x), std::min(mMin.y, b.mMin.y), std::min(mMin.z, b.mMin.z)),
+				 CVector(std::max(mMax.x, b.mMax.x), std::max(mMax.y, b.mMax.y), std::max(mMax.z, b.mMax.z)) };
+#else
+		return { CVector(std::min(mMin.x, b.mMin.x), std::min(mMin.y, b.mMin.y)),
+				 CVector(std::max(mMax.x, b.mMax.x), std::max(mMax.y, b.mMax.y)) };
+#endif
+	}
+
+	// Extends the box along the displacement d only, on the side it points to
+	void Extend(const CVector& d)
+	{
+		(d.x < 0.f ? mMin.x : mMax.x) += d.x;
+		(d.y < 0.f ? mMin.y : mMax.y) += d.y;
+#ifdef _3D
+		(d.z < 0.f ? mMin.z : mMax.z) += d.z;
+#endif
+	}
+
+	// Cost of the box for the tree heuristics: perimeter in 2D, surface in 3D
+	float Area() const
+	{
+		const auto d = mMax - mMin;
+#ifdef _3D
+		return 2.f * (d.x * d.y + d.y * d.z + d.z * d.x);
+#else
+		return 2.f * (d.x + d.y);
+#endif
+	}
+};
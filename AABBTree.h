@@ -0,0 +1,375 @@
+#pragma once
+
+#include "AABB.h"
+
+// Dynamic bounding volume tree, as an alternative broadphase to the grids that adapts to the distribution of the spheres
+// Every sphere is a leaf whose box is fat: grown by a margin and by a few frames of its velocity, so the sphere can
+// move for a while before leaving it. Only the spheres that left their fat box are removed and inserted again, at the
+// start of the frame. Insertion picks the sibling with the lowest growth of area and the tree is kept balanced with
+// rotations, as the dynamic trees of Box2D and Bullet
+// The nodes are pooled in one array, free nodes are linked through mParent
+class AABBTree
+{
+
+public:
+
+	static constexpr int KNull = -1;
+
+	// Fat boxes are grown by this many frames of velocity, plus this fraction of the collision range of the sphere
+	static constexpr float KPredictedFrames = 4.f;
+	static constexpr float KMarginScale = 0.1f;
+
+	struct SNode
+	{
+		SAABB mBox;
+		int   mParent;		// Next free node when the node is free
+		int   mChild[2];
+		int   mSphere;		// Sphere of a leaf, KNull for the other nodes
+		int   mHeight;		// 0 for the leaves, -1 for the free nodes
+	};
+
+	std::vector<SNode> mNodes;
+	int mRoot = KNull;
+	int mFreeList = KNull;
+
+	std::vector<int> mLeaf;		// Leaf of every sphere of the store, KNull if the sphere is not in the tree
+
+	// The moving spheres in the order of their leaves, querying them in this order the nodes visited by one query
+	// are still in the cache for the next one
+	std::vector<uint32_t> mQueryOrder;
+
+
+	bool IsLeaf(int node) const { return mNodes[node].mChild[0] == KNull; }
+
+	// Inserts all the spheres of the store, only the moving ones when the blocking ones are in the BVH
+	void Build()
+	{
+		const auto& spheres = gSpheresCollisionInfo;
+
+		mNodes.clear();
+		mNodes.reserve(2 * spheres.Size());
+		mRoot = KNull;
+		mFreeList = KNull;
+		mLeaf.assign(spheres.Size(), KNull);
+
+		for (auto s = gSettings.mBlockerBVH ? spheres.mNumBlocking : 0u; s < spheres.Size(); ++s) Add(s);
+
+		UpdateQueryOrder();
+	}
+
+	void Add(uint32_t sphere)
+	{
+		const auto leaf = AllocateNode();
+		mNodes[leaf].mBox = FatBox(sphere);
+		mNodes[leaf].mSphere = static_cast<int>(sphere);
+		mNodes[leaf].mHeight = 0;
+		mLeaf[sphere] = leaf;
+
+		InsertLeaf(leaf);
+	}
+
+	void Remove(uint32_t sphere)
+	{
+		const auto leaf = mLeaf[sphere];
+		RemoveLeaf(leaf);
+		FreeNode(leaf);
+		mLeaf[sphere] = KNull;
+	}
+
+	// Moves the moving spheres that left their fat box, the others keep their leaf
+	void Update()
+	{
+		const auto& spheres = gSpheresCollisionInfo;
+
+		for (auto s = spheres.mNumBlocking; s < spheres.Size(); ++s)
+		{
+			if (mNodes[mLeaf[s]].mBox.Contains(SAABB::OfSphere(s))) continue;
+
+			const auto leaf = mLeaf[s];
+			RemoveLeaf(leaf);
+			mNodes[leaf].mBox = FatBox(s);
+			InsertLeaf(leaf);
+		}
+
+		UpdateQueryOrder();
+	}
+
+	// Points the leaves to the new index of the spheres [first, first + order.size()) after the store was permuted by
+	// SSphereStore::Permute
+	void Renumber(uint32_t first, const std::vector<uint32_t>& order)
+	{
+		if (mLeaf.empty()) return;	// Not built yet
+
+		SSphereStore::PermuteColumn(mLeaf, first, order);
+		for (auto s = first; s != first + order.size(); ++s)
+		{
+			if (mLeaf[s] != KNull) mNodes[mLeaf[s]].mSphere = static_cast<int>(s);
+		}
+
+		UpdateQueryOrder();
+	}
+
+	// Removes the leaves of the spheres removed by SSphereStore::SwapRemoveOrder and points the others to their new index
+	void Compact(const std::vector<uint32_t>& newIndex)
+	{
+		if (mLeaf.empty()) return;	// Not built yet
+
+		for (uint32_t s = 0; s < newIndex.size(); ++s)
+		{
+			if (newIndex[s] == SSphereStore::KRemoved && mLeaf[s] != KNull) Remove(s);
+		}
+		for (uint32_t s = 0; s < newIndex.size(); ++s)
+		{
+			if (newIndex[s] != SSphereStore::KRemoved && mLeaf[s] != KNull) mNodes[mLeaf[s]].mSphere = static_cast<int>(newIndex[s]);
+		}
+		SSphereStore::CompactColumn(mLeaf, newIndex);
+
+		// The leaves keep their order, the moving spheres are only renamed
+		uint32_t n = 0;
+		for (const auto s : mQueryOrder)
+		{
+			if (newIndex[s] != SSphereStore::KRemoved) mQueryOrder[n++] = newIndex[s];
+		}
+		mQueryOrder.resize(n);
+	}
+
+	// Calls visit(sphere) for every sphere whose fat box overlaps the box
+	template<typename Visit>
+	void Query(const SAABB& box, Visit visit) const
+	{
+		if (mRoot == KNull) return;
+
+		// The tree is kept balanced, its height stays far below the size of the stack
+		int stack[256];
+		auto top = 0;
+		stack[top++] = mRoot;
+
+		while (top > 0)
+		{
+			const auto& node = mNodes[stack[--top]];
+			if (!node.mBox.Overlaps(box)) continue;
+
+			if (node.mChild[0] == KNull)
+			{
+				visit(static_cast<uint32_t>(node.mSphere));
+			}
+			else
+			{
+				stack[top++] = node.mChild[1];
+				stack[top++] = node.mChild[0];
+			}
+		}
+	}
+
+private:
+
+	void UpdateQueryOrder()
+	{
+		const auto& spheres = gSpheresCollisionInfo;
+
+		mQueryOrder.clear();
+		if (mRoot == KNull) return;
+
+		std::vector<int> stack{ mRoot };
+		while (!stack.empty())
+		{
+			const auto& node = mNodes[stack.back()];
+			stack.pop_back();
+
+			if (node.mChild[0] != KNull)
+			{
+				stack.push_back(node.mChild[1]);
+				stack.push_back(node.mChild[0]);
+			}
+			else if (!spheres.IsBlocking(node.mSphere))
+			{
+				mQueryOrder.push_back(static_cast<uint32_t>(node.mSphere));
+			}
+		}
+	}
+
+	// The blocking spheres never move, their box is not grown
+	static SAABB FatBox(uint32_t sphere)
+	{
+		const auto& spheres = gSpheresCollisionInfo;
+		if (spheres.IsBlocking(sphere)) return SAABB::OfSphere(sphere);
+
+		auto box = SAABB::OfSphere(sphere, spheres.mRadius[sphere] * KCollisionRangeScale * KMarginScale);
+		box.Extend(spheres.Velocity(sphere) * (gSettings.mTimeStep * KPredictedFrames));
+		return box;
+	}
+
+	int AllocateNode()
+	{
+		if (mFreeList == KNull)
+		{
+			mNodes.emplace_back();
+			mFreeList = static_cast<int>(mNodes.size()) - 1;
+			mNodes[mFreeList].mParent = KNull;
+		}
+
+		const auto node = mFreeList;
+		mFreeList = mNodes[node].mParent;
+		mNodes[node].mParent = KNull;
+		mNodes[node].mChild[0] = KNull;
+		mNodes[node].mChild[1] = KNull;
+		mNodes[node].mSphere = KNull;
+		mNodes[node].mHeight = 0;
+		return node;
+	}
+
+	void FreeNode(int node)
+	{
+		mNodes[node].mParent = mFreeList;
+		mNodes[node].mHeight = -1;
+		mFreeList = node;
+	}
+
+	void InsertLeaf(int leaf)
+	{
+		if (mRoot == KNull)
+		{
+			mRoot = leaf;
+			mNodes[leaf].mParent = KNull;
+			return;
+		}
+
+		// Walk down to the sibling whose box grows the least, counting the growth of all the boxes above it
+		const auto leafBox = mNodes[leaf].mBox;
+		auto index = mRoot;
+		while (!IsLeaf(index))
+		{
+			const auto& node = mNodes[index];
+			const auto area = node.mBox.Area();
+			const auto combinedArea = node.mBox.Union(leafBox).Area();
+
+			// Cost of making a new parent for this node and the leaf, and cost pushed down to the children
+			const auto cost = 2.f * combinedArea;
+			const auto inheritanceCost = 2.f * (combinedArea - area);
+
+			float childCost[2];
+			for (auto c = 0; c < 2; ++c)
+			{
+				const auto& child = mNodes[node.mChild[c]];
+				const auto childArea = child.mBox.Union(leafBox).Area();
+				childCost[c] = (child.mChild[0] == KNull ? childArea : childArea - child.mBox.Area()) + inheritanceCost;
+			}
+
+			if (cost < childCost[0] && cost < childCost[1]) break;
+
+			index = childCost[0] < childCost[1] ? node.mChild[0] : node.mChild[1];
+		}
+
+		// New parent of the sibling and the leaf
+		const auto sibling = index;
+		const auto oldParent = mNodes[sibling].mParent;
+		const auto newParent = AllocateNode();
+		mNodes[newParent].mParent = oldParent;
+		mNodes[newParent].mBox = leafBox.Union(mNodes[sibling].mBox);
+		mNodes[newParent].mHeight = mNodes[sibling].mHeight + 1;
+		mNodes[newParent].mChild[0] = sibling;
+		mNodes[newParent].mChild[1] = leaf;
+		mNodes[sibling].mParent = newParent;
+		mNodes[leaf].mParent = newParent;
+
+		if (oldParent == KNull)
+			mRoot = newParent;
+		else
+			mNodes[oldParent].mChild[mNodes[oldParent].mChild[0] == sibling ? 0 : 1] = newParent;
+
+		Refit(mNodes[leaf].mParent);
+	}
+
+	void RemoveLeaf(int leaf)
+	{
+		if (leaf == mRoot)
+		{
+			mRoot = KNull;
+			return;
+		}
+
+		const auto parent = mNodes[leaf].mParent;
+		const auto grandParent = mNodes[parent].mParent;
+		const auto sibling = mNodes[parent].mChild[mNodes[parent].mChild[0] == leaf ? 1 : 0];
+
+		// The sibling takes the place of the parent
+		FreeNode(parent);
+		mNodes[sibling].mParent = grandParent;
+		if (grandParent == KNull)
+		{
+			mRoot = sibling;
+			return;
+		}
+
+		mNodes[grandParent].mChild[mNodes[grandParent].mChild[0] == parent ? 0 : 1] = sibling;
+		Refit(grandParent);
+	}
+
+	// Balances and updates the boxes and heights from the node up to the root
+	void Refit(int index)
+	{
+		while (index != KNull)
+		{
+			index = Balance(index);
+
+			auto& node = mNodes[index];
+			const auto& child0 = mNodes[node.mChild[0]];
+			const auto& child1 = mNodes[node.mChild[1]];
+			node.mHeight = 1 + std::max(child0.mHeight, child1.mHeight);
+			node.mBox = child0.mBox.Union(child1.mBox);
+
+			index = node.mParent;
+		}
+	}
+
+	// If one child of the node a is more than one level taller than the other, rotates the taller child up to the
+	// place of a. Returns the node now at the place of a
+	int Balance(int a)
+	{
+		if (IsLeaf(a) || mNodes[a].mHeight < 2) return a;
+
+		const auto b = mNodes[a].mChild[0];
+		const auto c = mNodes[a].mChild[1];
+		const auto balance = mNodes[c].mHeight - mNodes[b].mHeight;
+
+		if (balance > 1) return Rotate(a, c, 1);
+		if (balance < -1) return Rotate(a, b, 0);
+		return a;
+	}
+
+	// Rotates up the child up of a, which is its child on the side upSide
+	// up takes the place of a and keeps its taller child, a takes the shorter one in place of up and keeps its other child
+	int Rotate(int a, int up, int upSide)
+	{
+		const auto f = mNodes[up].mChild[0];
+		const auto g = mNodes[up].mChild[1];
+
+		// up takes the place of a
+		mNodes[up].mChild[0] = a;
+		mNodes[up].mParent = mNodes[a].mParent;
+		mNodes[a].mParent = up;
+
+		const auto parent = mNodes[up].mParent;
+		if (parent == KNull)
+			mRoot = up;
+		else
+			mNodes[parent].mChild[mNodes[parent].mChild[0] == a ? 0 : 1] = up;
+
+		// The taller child of up stays with it, the other one replaces up as the child of a
+		const auto taller = mNodes[f].mHeight > mNodes[g].mHeight ? f : g;
+		const auto shorter = taller == f ? g : f;
+
+		mNodes[up].mChild[1] = taller;
+		mNodes[a].mChild[upSide] = shorter;
+		mNodes[shorter].mParent = a;
+
+		const auto& other = mNodes[mNodes[a].mChild[1 - upSide]];
+		mNodes[a].mBox = other.mBox.Union(mNodes[shorter].mBox);
+		mNodes[a].mHeight = 1 + std::max(other.mHeight, mNodes[shorter].mHeight);
+
+		mNodes[up].mBox = mNodes[a].mBox.Union(mNodes[taller].mBox);
+		mNodes[up].mHeight = 1 + std::max(mNodes[a].mHeight, mNodes[taller].mHeight);
+
+		return up;
+	}
+};
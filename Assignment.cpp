@@ -1,340 +1,623 @@
 // Assignment.cpp: A program using the TL-Engine
 
 #include "Collision.h"
+#include "TaskScheduler.h"
 
 
 
 bool SceneSetup()
 {
 
-	gCollisionInfoData.erase(gCollisionInfoData.begin(), gCollisionInfoData.end());
+	gCollisionLog.Clear();
 
-	gMovingSpheresCollisionInfo.erase(gMovingSpheresCollisionInfo.begin(), gMovingSpheresCollisionInfo.end());
-	gBlockingSpheresCollisionInfo.erase(gBlockingSpheresCollisionInfo.begin(), gBlockingSpheresCollisionInfo.end());
-
-	gMovingSpheresCollisionInfo.reserve(KNumOfSpheres / 2);
-	gBlockingSpheresCollisionInfo.reserve(KNumOfSpheres / 2);
+	gSpheresCollisionInfo.Clear();
+	gSpheresCollisionInfo.Reserve(gSettings.mNumSpheres);
+	gSpheres.assign(gSettings.mNumSpheres, SSphere());
+	gSphereHandles.Clear();
+	gDeadSpheres.clear();
+#ifdef _VISUALIZATION_ON
+	for (auto& positions : gRenderPositions) positions.resize(gSettings.mNumSpheres);
+#endif
+#ifdef _LOG
+	gSphereNames.resize(gSettings.mNumSpheres);
+#endif
 
 
 #ifdef _VISUALIZATION_ON
 	myCamera = myEngine->CreateCamera(kManual, 0.0f, 0.f, -2000.f);
-	const auto sphereMesh = myEngine->LoadMesh("sphere.x");
-	const auto blockedMesh = myEngine->LoadMesh("SphereBlocked.x");
+	mySphereMesh = myEngine->LoadMesh("sphere.x");
+	myBlockedMesh = myEngine->LoadMesh("SphereBlocked.x");
 #endif
 	
-	// Get all the spheres pointers and arrange them into the grid
+	// Centres of the clusters the spheres are spawned around, if any
+	std::vector<CVector> clusters(gSettings.mNumClusters);
+	for (auto& centre : clusters) centre = CVector::Rand() * (gSettings.mRangeSpawn - gSettings.mClusterRadius);
+
+	// Get all the spheres and arrange them into the grid
+	// The blocking spheres are added first, the store expects them before the moving ones
 
-	for (auto i = 0; i < KNumOfSpheres / 2; ++i)
+	for (auto i = 0u; i < gSettings.mNumSpheres; ++i)
 	{
-		SSphereCollisionInfo* s = new SSphereCollisionInfo;
+		const bool blocking = i < gSettings.mNumSpheres / 2;
 		SSphere ss;
 
-		s->mRadius = Random(0.5f, KRangeRadius);
-		s->index = -i;
+		const auto radius = Random(0.5f, gSettings.mRangeRadius);
 		ss.mColour = CVector3::Rand();
-		ss.mName = std::to_string(i);
-
-#ifdef _3D
-		s->mVelocity = CVector3::Rand() * KRangeVelocity;
-		s->mPosition = CVector3::Rand() * (KRangeSpawn - s->mRadius);
-		s->mPosition += CVector3::Rand();
-		s->mPosition %= KRangeSpawn;
-#else
-		s->mVelocity = CVector2::Rand() * KRangeVelocity;
-		s->mPosition = CVector2::Rand() * (KRangeSpawn - s->mRadius);
-		s->mPosition += CVector2::Rand();
-		s->mPosition %= KRangeSpawn;
+		ss.mId = i;
+#ifdef _LOG
+		gSphereNames[i] = blocking ? "Blocking " + std::to_string(i) : "Moving " + std::to_string(i - gSettings.mNumSpheres / 2);
 #endif
 
+		const auto velocity = CVector::Rand() * gSettings.mRangeVelocity;
+		CVector position;
+		if (clusters.empty())
+		{
+			position = CVector::Rand() * (gSettings.mRangeSpawn - radius);
+			position += CVector::Rand();
+			position %= gSettings.mRangeSpawn;
+		}
+		else
+			position = clusters[i % clusters.size()] + CVector::Rand() * gSettings.mClusterRadius;
 
-
 #ifdef _VISUALIZATION_ON
-		ss.mModel = blockedMesh->CreateModel();
-		ss.mModel->Scale(s->mRadius);
+		ss.mModel = (blocking ? myBlockedMesh : mySphereMesh)->CreateModel();
+		ss.mModel->Scale(radius);
+#endif
+		const auto s = gSpheresCollisionInfo.Add(position, velocity, radius, blocking);
+		ss.mHandle = gSphereHandles.Create(s);
+#ifdef _VISUALIZATION_ON
+		for (auto& positions : gRenderPositions) positions[ss.mHandle.mSlot] = position;
 #endif
-			gBlockingSpheres[i] = ss;
-			gBlockingSpheresCollisionInfo.push_back(*s);
-			gGrid->Add(&gBlockingSpheresCollisionInfo.back());
+		gSpheres[s] = std::move(ss);
 	}
 
-	for (auto i = 0; i < KNumOfSpheres / 2; ++i)
-	{
+	// The blocking spheres never move, they are sorted once before the broadphases are built
+	if (gSettings.mReorderFrames) ReorderSpheres(0, gSpheresCollisionInfo.mNumBlocking);
 
-		SSphereCollisionInfo* s = new SSphereCollisionInfo;
-		SSphere ss;
-
-		s->mRadius = Random(0.5f, KRangeRadius);
-		s->index = i;
-		ss.mColour = CVector3::Rand();
-		ss.mName = std::to_string(i);
+	if (gSettings.mBroadphase == EBroadphase::Grid)
+	{
+		for (auto s = gSettings.mBlockerBVH ? gSpheresCollisionInfo.mNumBlocking : 0u; s < gSpheresCollisionInfo.Size(); ++s) gGrid->Add(s);
+	}
 
-#ifdef _3D
-			s->mVelocity =	CVector3::Rand() * KRangeVelocity;
-			s->mPosition =  CVector3::Rand() * (KRangeSpawn - s->mRadius);
-			s->mPosition += CVector3::Rand();
-			s->mPosition %= KRangeSpawn;
-#else
-			s->mVelocity = CVector2::Rand() * KRangeVelocity;
-			s->mPosition = CVector2::Rand() * (KRangeSpawn - s->mRadius);
-			s->mPosition += CVector2::Rand();
-			s->mPosition %= KRangeSpawn;
-#endif
+	if (gSettings.mBlockerBVH) gBlockerBVH->Build();
 
+	if (gSettings.mBroadphase == EBroadphase::SweepAndPrune) gSweepAndPrune->Build();
+	if (gSettings.mBroadphase == EBroadphase::AABBTree) gAABBTree->Build();
+	if (gSettings.mBroadphase == EBroadphase::LooseTree) gLooseTree->Build();
 
+	// The migration queues keep their capacity from frame to frame, a part of the moving spheres is reserved upfront so
+	// they rarely grow while the threads move the spheres
+	const auto reserve = gSpheresCollisionInfo.NumMoving() / 16 + 64;
+	for (auto& migrations : gMigrations) migrations.reserve(reserve / gTaskScheduler->NumThreads());
+	gGridMigrations.reserve(reserve);
 
-#ifdef _VISUALIZATION_ON
-			ss.mModel = sphereMesh->CreateModel();
-			ss.mModel->Scale(s->mRadius);
+#ifdef _LOG
+	// Every log file starts with the names of the spheres
+	delete gLogWriter;
+	gLogWriter = new LogWriter(gSettings.mLogPath, static_cast<uint64_t>(gSettings.mLogFileSize) << 20, gSphereNames);
 #endif
-			gMovingSpheres[i] = ss;
-			gMovingSpheresCollisionInfo.push_back(*s);
-			gGrid->Add(&gMovingSpheresCollisionInfo.back());
-	}
 
 	return true;
 }
 
 
-void UpdateSpheresInGrid(SSphereCollisionInfo* s)
-{
-}
 
-
-
-void Log(SSphere* first, SSphere* second)
+// Records the collision, see CollisionLog.h
+// The spheres are recorded by id, as their index in the store changes when it is reordered
+void Log(uint32_t first, uint32_t second, int64_t time)
 {
-	CollisionInfoData c;
-	c.healthRemaining[0] = first->mHealth;
-	c.healthRemaining[1] = second->mHealth;
-	c.name[0] = first->mName;
-	c.name[1] = second->mName;
-	c.time = time(0);
-
-	gCollisionInfoData.emplace_back(c);
+	gCollisionLog.Record(gSpheres[first].mId, gSpheres[second].mId, gSpheres[first].mHealth, gSpheres[second].mHealth, time);
 }
 
-void PrintLog()
+// Hands the collisions of the frame to the log writer thread as binary records, LogToText renders them as text
+void WriteLog()
 {
+	auto& batch = gLogWriter->AcquireBatch();
 
-	ofstream file;
-
-	file.open("Output.txt");
-
-	for (const auto& i : gCollisionInfoData)
+	gCollisionLog.ForEach([&](const SCollisionEvent& i)
 	{
-		auto s = "[" + std::to_string(i.time) + "] Collision: " + i.name[0] + ", Health : " + std::to_string(i.healthRemaining[0]);
-		s.append(" with " + i.name[1] + ", Health : " + std::to_string(i.healthRemaining[1]));
+		SLogRecord record = {};
+		record.mTime = i.mTime;
+		record.mId[0] = i.mId[0];
+		record.mId[1] = i.mId[1];
+		record.mHealth[0] = i.mHealthRemaining[0];
+		record.mHealth[1] = i.mHealthRemaining[1];
+		batch.push_back(record);
+	});
+
+	gLogWriter->Submit(batch);
+	gCollisionLog.Clear();
+}
 
-		file << s << endl;
-	}
 
-	gCollisionInfoData.clear();
+// Inverse of the mass of the sphere, its area in 2D and its volume in 3D up to a constant, 0 for the blocking spheres
+// as they never move
+float InverseMass(uint32_t sphere)
+{
+	const auto& spheres = gSpheresCollisionInfo;
+	if (spheres.IsBlocking(sphere)) return 0.f;
 
-	file.close();
+	const auto radius = spheres.mRadius[sphere];
+#ifdef _3D
+	return 1.f / (radius * radius * radius);
+#else
+	return 1.f / (radius * radius);
+#endif
 }
 
-void Work(SSphereCollisionInfo* start, SSphereCollisionInfo* end)
+// Bounces the two spheres of the contact off each other with an impulse along the normal, shared by their masses
+// Spheres already moving apart are left as they are, so spheres still in range after a bounce can separate
+void ApplyContactImpulse(const SContact& contact)
 {
-	auto sphere = start;
-	while (sphere != end)
+	auto& spheres = gSpheresCollisionInfo;
+	const auto first = contact.mSphere[0];
+	const auto second = contact.mSphere[1];
+
+	// The blocking spheres have a velocity in the store but never move
+	const auto velocity = [&](uint32_t sphere)
 	{
 #ifdef _3D
-		CVector3 surfaceNormal;
+		return spheres.IsBlocking(sphere) ? CVector3(0.f, 0.f, 0.f) : spheres.Velocity(sphere);
 #else
-		CVector2 surfaceNormal;
+		return spheres.IsBlocking(sphere) ? CVector2(0.f, 0.f) : spheres.Velocity(sphere);
 #endif
+	};
 
-		auto c = CollisionSpatialPartitioning(sphere, surfaceNormal);
+	const auto normal = Normalise(contact.mNormal);
+	const auto speed = Dot(velocity(second) - velocity(first), normal);
+	if (speed >= 0.f) return;
 
-		if (c)
-		{
-			sphere->mPosition -= sphere->mVelocity * totalTime;
-			sphere->mVelocity = Reflect(sphere->mVelocity, surfaceNormal);
+	const auto inverseMassFirst = InverseMass(first);
+	const auto inverseMassSecond = InverseMass(second);
+	const auto impulse = -(1.f + KRestitution) * speed / (inverseMassFirst + inverseMassSecond);
 
-			if (c != sphere)
-			{
-				auto j = c->index;
-				auto i = sphere->index;
-				
-				(j < 0 ? gBlockingSpheres : gMovingSpheres)[std::abs(j)].mHealth -= 20;
-
-				gMovingSpheres[i].mHealth -= 20;
+	if (inverseMassFirst > 0.f) spheres.SetVelocity(first, spheres.Velocity(first) - normal * (impulse * inverseMassFirst));
+	if (inverseMassSecond > 0.f) spheres.SetVelocity(second, spheres.Velocity(second) + normal * (impulse * inverseMassSecond));
+}
 
+// Resolves every contact found by the threads once, for both of its spheres
+// The threads steal chunks of the broadphase from each other, so which thread found a contact changes from run to run.
+// The contacts are merged and sorted first, so a sphere with several contacts gets their impulses in the same order
+// whatever the number of threads. In continuous mode every sphere already has its first contact of the frame, the
+// contacts only count the collisions
+// The collisions are logged in the order they are resolved. The spheres whose health reaches 0 are queued to be
+// removed at the end of the frame, they still collide until then
+void ResolveContacts()
+{
 #ifdef _LOG
-				Log(&gMovingSpheres[i], &(j < 0 ? gBlockingSpheres : gMovingSpheres)[std::abs(j)]);
+	const auto now = static_cast<int64_t>(time(0));
 #endif
+
+	gSortedContacts.clear();
+	for (auto& contacts : gContacts)
+	{
+		for (auto contact : contacts)
+		{
+			if (contact.mSphere[0] > contact.mSphere[1])
+			{
+				std::swap(contact.mSphere[0], contact.mSphere[1]);
+				contact.mNormal = contact.mNormal * -1.f;
 			}
+			gSortedContacts.push_back(contact);
 		}
-		else
-			sphere->mPosition += sphere->mVelocity * totalTime;
+	}
+	std::sort(gSortedContacts.begin(), gSortedContacts.end());
 
-		// Update the sphere position in the partition after moved
+	const auto damage = [](uint32_t sphere)
+	{
+		auto& health = gSpheres[sphere].mHealth;
+		if (health == 0) return;
 
-		auto p = gGrid->GetPartition(sphere->mPosition);
-		auto p2 = sphere->mPartition;
-		if (p != p2)
-		{
-			gGrid->RemoveFromPartition(sphere);
-			auto ptr = sphere;
-			gGrid->Add(ptr);
-		}
+		health = health > KCollisionDamage ? health - KCollisionDamage : 0;
+		if (health == 0 && gSettings.mRemoveDead) gDeadSpheres.push_back(sphere);
+	};
+
+	for (const auto& contact : gSortedContacts)
+	{
+		const auto first = contact.mSphere[0];
+		const auto second = contact.mSphere[1];
+
+		if (!gSettings.mContinuous) ApplyContactImpulse(contact);
+
+		damage(first);
+		damage(second);
 
-		++sphere;
+#ifdef _LOG
+		Log(first, second, now);
+#endif
 	}
+}
+
+// Find the contacts of the partitions with index in [start, end)
+void FindContactsWork(uint32_t thread, uint32_t start, uint32_t end)
+{
+	FindContacts(start, end, gContacts[thread]);
+}
 
-	//// Resize arrays after any deletions
-	//uint32_t newSize = static_cast<uint32_t>(end - gSpheres.data());
-	//gSpheres.resize(newSize);
+// Find the contacts of the moving spheres with index in [start, end) with the blocking spheres
+void FindBlockerContactsWork(uint32_t thread, uint32_t start, uint32_t end)
+{
+	FindContactsBlockerBVH(start, end, gContacts[thread]);
 }
 
+// Find the first contact during the frame of the moving spheres with index in [start, end), see Continuous.h
+void FindImpactsWork(uint32_t thread, uint32_t start, uint32_t end)
+{
+	FindImpacts(start, end, gContacts[thread]);
+}
 
-void UpdateThread(uint32_t thread)
+// Move the moving spheres with index in [start, end), bouncing them off the walls
+// The spheres in contact were already bounced off each other by ResolveContacts. In continuous mode the sphere bounces
+// where it meets its first contact instead, which can be a wall, rather than stepping back
+void Work(uint32_t thread, uint32_t start, uint32_t end)
 {
+	auto& spheres = gSpheresCollisionInfo;
 
-	auto& worker = mUpdateSpheresWorkers[thread].first;
-	auto& work = mUpdateSpheresWorkers[thread].second;
-	while (true)
+	for (auto sphere = start; sphere != end; ++sphere)
 	{
+		CVector surfaceNormal;
+
+		bool collided = !gSettings.mContinuous && CollisionWithWalls(sphere, surfaceNormal);
+		if (!collided && spheres.mContact[sphere] != KNoCollision)
 		{
-			std::unique_lock<std::mutex> l(worker.lock);
-			worker.workReady.wait(l, [&]() { return !work.complete; });
+			surfaceNormal = spheres.mContactNormal[sphere];
+			collided = true;
 		}
+		spheres.mContact[sphere] = KNoCollision;
 
-		// We have some work so do it...
-		Work(work.start, work.end);
+		auto position = spheres.Position(sphere);
+		const auto velocity = spheres.Velocity(sphere);
 
+		if (collided)
 		{
-			// Flag the work is complete
-			// We also guard every normal access to shared variable "work.complete" with the same mutex
-			std::unique_lock<std::mutex> l(worker.lock);
-			work.complete = true;
+			if (gSettings.mContinuous)
+				position += velocity * (totalTime * spheres.mContactTime[sphere]);
+			else
+				position -= velocity * totalTime;
+			spheres.SetVelocity(sphere, Reflect(velocity, surfaceNormal));
+		}
+		else
+			position += velocity * totalTime;
+
+		spheres.SetPosition(sphere, position);
+
+		// Queue the sphere if it left its partition or node, the other broadphases are updated at the start of the frame
+		// Other threads are moving the spheres of the same partitions, so the spheres are only moved in the grid or the
+		// tree once all threads finished, see ApplyMigrations
+
+		if ((gSettings.mBroadphase == EBroadphase::Grid && gGrid->PartitionIndex(position) != spheres.mPartition[sphere]) ||
+			(gSettings.mBroadphase == EBroadphase::LooseTree && gLooseTree->LeftNode(sphere)))
+		{
+			gMigrations[thread].push_back(sphere);
 		}
-		// Send a signal back to the main thread to say the work is complete, loop back and wait for more work
-		worker.workReady.notify_one();
 	}
 }
 
+// Remove the migrating spheres of the partitions [start, end) from the grid, the swap with the last sphere of a
+// partition only touches spheres of the same partition
+void RemoveMigrationsWork(uint32_t /*thread*/, uint32_t start, uint32_t end)
+{
+	auto migration = std::lower_bound(gGridMigrations.begin(), gGridMigrations.end(), SMigration{ start, 0 });
+	for (; migration != gGridMigrations.end() && migration->mPartition < end; ++migration) gGrid->RemoveFromPartition(migration->mSphere);
+}
 
-void UpdateSpheres()
+// Add the migrating spheres going to the partitions [start, end) to the grid
+void AddMigrationsWork(uint32_t /*thread*/, uint32_t start, uint32_t end)
 {
-	if (bUsingMultithreading)
-	{
-		const auto nThreads = std::thread::hardware_concurrency();
-		const auto numSpheres = gMovingSpheresCollisionInfo.size();
-		const auto spheresPerSection = numSpheres / (nThreads + 1);
+	auto migration = std::lower_bound(gGridMigrations.begin(), gGridMigrations.end(), SMigration{ start, 0 });
+	for (; migration != gGridMigrations.end() && migration->mPartition < end; ++migration) gGrid->Add(migration->mSphere);
+}
 
-		auto       spheres = gMovingSpheresCollisionInfo.data();
+// Move in the grid or the loose tree the spheres that left their partition or node during the frame
+// The grid is updated in parallel without locks: the spheres are removed by threads owning the partitions they
+// leave, then added by threads owning the partitions they go to. The migrations are sorted by partition and sphere, and
+// each partition applies its own in that order, so the swap-removes and appends leave every partition in the same order
+// whichever thread found or moved the spheres. The loose tree can split nodes when a sphere is added, so the spheres
+// are moved in it on this thread, in order
+void ApplyMigrations()
+{
+	auto& spheres = gSpheresCollisionInfo;
 
-		for (uint32_t i = 0; i < nThreads; ++i)
+	if (gSettings.mBroadphase == EBroadphase::Grid)
+	{
+		gGridMigrations.clear();
+		for (auto& migrations : gMigrations)
 		{
-			auto& work = mUpdateSpheresWorkers[i].second;
-			work.start = spheres;
-			work.end = spheres + spheresPerSection;
+			for (const auto sphere : migrations) gGridMigrations.push_back({ static_cast<uint32_t>(spheres.mPartition[sphere]), sphere });
+			migrations.clear();
+		}
+		if (gGridMigrations.empty()) return;
 
-			// Flag the work as not yet complete
-			auto& workerThread = mUpdateSpheresWorkers[i].first;
-			{
-				// Guard every access to shared variable "work.complete" with a mutex (see BlockSpritesThread comments)
-				std::unique_lock<std::mutex> l(workerThread.lock);
-				work.complete = false;
-			}
+		const auto numPartitions = static_cast<uint32_t>(gGrid->mPartitions.size());
 
-			// Notify the worker thread via a condition variable - this will wake the worker thread up
-			workerThread.workReady.notify_one();
+		std::sort(gGridMigrations.begin(), gGridMigrations.end());
+		gTaskScheduler->ParallelFor(0, numPartitions, RemoveMigrationsWork);
 
-			spheres += spheresPerSection;
+		for (auto& migration : gGridMigrations) migration.mPartition = gGrid->PartitionIndex(spheres.Position(migration.mSphere));
+		std::sort(gGridMigrations.begin(), gGridMigrations.end());
+		gTaskScheduler->ParallelFor(0, numPartitions, AddMigrationsWork);
+	}
+	else if (gSettings.mBroadphase == EBroadphase::LooseTree)
+	{
+		std::vector<uint32_t> moved;
+		for (auto& migrations : gMigrations)
+		{
+			moved.insert(moved.end(), migrations.begin(), migrations.end());
+			migrations.clear();
 		}
+		std::sort(moved.begin(), moved.end());
 
-		// do the remaining work
-		Work(spheres, spheres + spheresPerSection);
-
-		// Wait for all the workers to finish
-		for (uint32_t i = 0; i < mNumWorkers; ++i)
+		for (const auto sphere : moved)
 		{
-			auto& workerThread = mUpdateSpheresWorkers[i].first;
-			auto& work = mUpdateSpheresWorkers[i].second;
-
-			// Wait for a signal via a condition variable indicating that the worker is complete
-			// See comments in BlockSpritesThread regarding the mutex and the wait method
-			std::unique_lock<std::mutex> l(workerThread.lock);
-			workerThread.workReady.wait(l, [&]() { return work.complete; });
+			gLooseTree->Remove(sphere);
+			gLooseTree->Add(sphere);
 		}
 	}
-	else
+}
+
+// Removes the spheres whose health reached 0 during the frame from the broadphase in use, the blocker BVH and the
+// store, and destroys their handles. The store is compacted with swap-removes (see SSphereStore::SwapRemoveOrder), so
+// only the spheres moved into the freed places are renamed in the broadphase and get their handle updated
+void RemoveDeadSpheres()
+{
+	if (gDeadSpheres.empty()) return;
+
+	for (const auto sphere : gDeadSpheres)
 	{
-		Work(gMovingSpheresCollisionInfo.data(), gMovingSpheresCollisionInfo.data() + gMovingSpheresCollisionInfo.size());
+		gSphereHandles.Destroy(gSpheres[sphere].mHandle);
+#ifdef _VISUALIZATION_ON
+		(gSpheresCollisionInfo.IsBlocking(sphere) ? myBlockedMesh : mySphereMesh)->RemoveModel(gSpheres[sphere].mModel);
+#endif
 	}
-}
 
+	const auto newIndex = gSpheresCollisionInfo.SwapRemoveOrder(gDeadSpheres);
+	gDeadSpheres.clear();
 
-bool GameLoop()
-{
-	UpdateSpheres();
+	// The broadphases rebuilt every frame need nothing
+	switch (gSettings.mBroadphase)
+	{
+	case EBroadphase::Grid:          gGrid->Compact(newIndex); break;
+	case EBroadphase::SweepAndPrune: gSweepAndPrune->Compact(newIndex); break;
+	case EBroadphase::AABBTree:      gAABBTree->Compact(newIndex); break;
+	case EBroadphase::LooseTree:     gLooseTree->Compact(newIndex); break;
+	default: break;
+	}
+	if (gSettings.mBlockerBVH) gBlockerBVH->Compact(newIndex);
 
+	gSpheresCollisionInfo.Compact(newIndex);
+	SSphereStore::CompactColumn(gSpheres, newIndex);
 
-#ifdef _VISUALIZATION_ON
+	for (uint32_t s = 0; s < newIndex.size(); ++s)
+	{
+		if (newIndex[s] != SSphereStore::KRemoved && newIndex[s] != s) gSphereHandles.Move(gSpheres[newIndex[s]].mHandle, newIndex[s]);
+	}
+}
 
-	workTime = myEngine->Timer();
 
-#ifdef _3D
-	for (int i = 0u; i < KNumOfSpheres / 2; ++i)
+// A frame is done in three steps: the broad phase finds every colliding pair once, the contacts are resolved, then
+// the moving spheres are moved
+// The steps are separated by the end of their ParallelFor, and each only writes what no other thread of the step reads:
+// finding the contacts only reads the positions, the contacts are resolved on one thread, and moving a sphere only
+// reads and writes that sphere. The positions read by a step are all from the same frame, as if double buffered, and
+// the result does not depend on the number of threads or on which thread ran which chunk (see --checksum)
+// In continuous mode the first step finds the first contact of every moving sphere during the frame, the threads only
+// writing the contact of the spheres of their chunks
+// The spheres destroyed during the frame are removed once everything else is done
+void UpdateSpheres()
+{
+	static uint32_t frame = 0;
+	if (gSettings.mReorderFrames && frame++ % gSettings.mReorderFrames == 0) ReorderSpheres(gSpheresCollisionInfo.mNumBlocking, gSpheresCollisionInfo.Size());
+
+	if (gSettings.mBroadphase == EBroadphase::CompactGrid) gCompactGrid->Build();
+	if (gSettings.mBroadphase == EBroadphase::HashGrid) gHashGrid->Build();
+	if (gSettings.mBroadphase == EBroadphase::SweepAndPrune) gSweepAndPrune->Update();
+	if (gSettings.mBroadphase == EBroadphase::AABBTree) gAABBTree->Update();
+
+	for (auto& contacts : gContacts) contacts.clear();
+	if (gSettings.mContinuous)
 	{
-		gBlockingSpheres[i].mModel->SetPosition(gBlockingSpheresCollisionInfo[i].mPosition.x, gBlockingSpheresCollisionInfo[i].mPosition.y, gBlockingSpheresCollisionInfo[i].mPosition.z);
+		gSweptMargin = MaxSweptDistance();
+		gTaskScheduler->ParallelFor(gSpheresCollisionInfo.mNumBlocking, gSpheresCollisionInfo.Size(), FindImpactsWork);
 	}
-	for (int i = 0u; i < KNumOfSpheres / 2; ++i)
+	else
 	{
-		gMovingSpheres[i].mModel->SetPosition(gMovingSpheresCollisionInfo[i].mPosition.x, gMovingSpheresCollisionInfo[i].mPosition.y,gMovingSpheresCollisionInfo[i].mPosition.z);
+		gTaskScheduler->ParallelFor(0, NumBroadphasePartitions(), FindContactsWork);
+		if (gSettings.mBlockerBVH) gTaskScheduler->ParallelFor(gSpheresCollisionInfo.mNumBlocking, gSpheresCollisionInfo.Size(), FindBlockerContactsWork);
 	}
-#else
 
-	for (int i = 0u; i < KNumOfSpheres / 2; ++i)
+	ResolveContacts();
+
+	gTaskScheduler->ParallelFor(gSpheresCollisionInfo.mNumBlocking, gSpheresCollisionInfo.Size(), Work);
+
+	ApplyMigrations();
+
+	RemoveDeadSpheres();
+}
+
+
+#ifdef _VISUALIZATION_ON
+
+// Copies the positions of the moving spheres to the back render buffer and makes it the front one, see gRenderPositions
+// The blocking spheres never move, they are in both buffers from SceneSetup
+void SnapshotPositions()
+{
+	const auto& spheres = gSpheresCollisionInfo;
+	auto& back = gRenderPositions[1 - gRenderFront];
+	for (auto i = spheres.mNumBlocking; i < spheres.Size(); ++i) back[gSpheres[i].mHandle.mSlot] = spheres.Position(i);
+	gRenderFront = 1 - gRenderFront;
+}
+
+// Runs the physics steps due for the time the last frame took, then places the models between the last two steps
+// The simulation advances by the fixed step totalTime, so its result and its cost per step do not depend on the frame
+// rate. The elapsed time is accumulated, as many steps run as fit in it and the rest is carried to the next frame.
+// At most gSettings.mMaxSteps steps run per frame: when the steps take longer than the time they simulate, catching up
+// would make every frame slower than the last, so the time behind is dropped and the simulation runs slower instead
+// The time carried over is the fraction of a step the simulation is ahead of the frame, the models are drawn that far
+// between the snapshots of the last two steps. Only these two are taken, a frame with no step keeps the last ones
+bool GameLoop(float elapsed)
+{
+	static float accumulator = 0.f;
+	accumulator += elapsed;
+
+	auto steps = static_cast<uint32_t>(accumulator / totalTime);
+	if (steps > gSettings.mMaxSteps)
 	{
-		gBlockingSpheres[i].mModel->SetPosition(gBlockingSpheresCollisionInfo[i].mPosition.x, gBlockingSpheresCollisionInfo[i].mPosition.y, 0.0f);
+		steps = gSettings.mMaxSteps;
+		accumulator = steps * totalTime;
 	}
-	for (int i = 0u; i < KNumOfSpheres / 2; ++i)
+
+	for (uint32_t step = 0; step < steps; ++step)
 	{
-		gMovingSpheres[i].mModel->SetPosition(gMovingSpheresCollisionInfo[i].mPosition.x, gMovingSpheresCollisionInfo[i].mPosition.y, 0.0f);
+		UpdateSpheres();
+		accumulator -= totalTime;
+		if (step + 2 >= steps) SnapshotPositions();
+
+#ifdef _LOG
+		WriteLog();
+#endif
 	}
+	accumulator = std::max(accumulator, 0.f);
+
+	workTime = myEngine->Timer();
+
+	const auto alpha = std::min(accumulator / totalTime, 1.f);
+	const auto& previous = gRenderPositions[1 - gRenderFront];
+	const auto& current = gRenderPositions[gRenderFront];
+	for (auto& sphere : gSpheres)
+	{
+		const auto slot = sphere.mHandle.mSlot;
+		const auto position = previous[slot] + (current[slot] - previous[slot]) * alpha;
+#ifdef _3D
+		sphere.mModel->SetPosition(position.x, position.y, position.z);
+#else
+		sphere.mModel->SetPosition(position.x, position.y, 0.0f);
 #endif
+	}
 
 
 	myCamera->MoveZ(myEngine->GetMouseWheelMovement() * 100);
-	myCamera->MoveLocalY(myEngine->KeyHeld(Key_W) * 1000.0f * totalTime);
-	myCamera->MoveLocalY(myEngine->KeyHeld(Key_S) * -1000.f * totalTime);
-	myCamera->MoveLocalX(myEngine->KeyHeld(Key_D) * 1000.0f * totalTime);
-	myCamera->MoveLocalX(myEngine->KeyHeld(Key_A) * -1000.f * totalTime);
+	myCamera->MoveLocalY(myEngine->KeyHeld(Key_W) * 1000.0f * elapsed);
+	myCamera->MoveLocalY(myEngine->KeyHeld(Key_S) * -1000.f * elapsed);
+	myCamera->MoveLocalX(myEngine->KeyHeld(Key_D) * 1000.0f * elapsed);
+	myCamera->MoveLocalX(myEngine->KeyHeld(Key_A) * -1000.f * elapsed);
 	if (myEngine->KeyHit(Key_Escape)) return false;
 	if (myEngine->KeyHit(Key_Space)) bUsingMultithreading = !bUsingMultithreading;
 
+	return true;
+}
+
 #endif
 
-	return true;
+
+
+
+#ifndef _VISUALIZATION_ON
+
+// FNV-1a hash of the bits of the positions, velocities and health of all the spheres, in the order of the store
+uint64_t StateChecksum()
+{
+	uint64_t hash = 14695981039346656037ull;
+	const auto add = [&](const void* data, size_t size)
+	{
+		for (size_t b = 0; b < size; ++b)
+		{
+			hash ^= static_cast<const uint8_t*>(data)[b];
+			hash *= 1099511628211ull;
+		}
+	};
+
+	const auto& spheres = gSpheresCollisionInfo;
+	for (const auto* column : { &spheres.mPositionX, &spheres.mPositionY, &spheres.mVelocityX, &spheres.mVelocityY })
+		add(column->data(), column->size() * sizeof(float));
+#ifdef _3D
+	for (const auto* column : { &spheres.mPositionZ, &spheres.mVelocityZ })
+		add(column->data(), column->size() * sizeof(float));
+#endif
+	for (const auto& sphere : gSpheres) add(&sphere.mHealth, sizeof(sphere.mHealth));
+
+	return hash;
 }
 
+// Run the simulation for the requested number of frames, timing every call to UpdateSpheres
+void RunHeadless()
+{
+	using Milliseconds = chrono::duration<double, std::milli>;
+
+	std::vector<double> frameTimes;
+	frameTimes.reserve(gSettings.mNumFrames);
+
+	// The number of moving spheres drops as they are destroyed
+	double movingUpdated = 0.0;
+
+	for (uint32_t frame = 0; frame < gSettings.mNumFrames; ++frame)
+	{
+		movingUpdated += gSpheresCollisionInfo.NumMoving();
+
+		const auto begin = chrono::steady_clock::now();
+		UpdateSpheres();
+		const auto end = chrono::steady_clock::now();
+
+		frameTimes.push_back(Milliseconds(end - begin).count());
+
+		if (gSettings.mPrintFrames)
+			std::cout << "Frame " << frame << ": " << frameTimes.back() << " [ms]\n";
+
+#ifdef _LOG
+		WriteLog();
+#endif
+	}
+
+	if (frameTimes.empty()) return;
+
+	double total = 0.0;
+	for (const auto t : frameTimes) total += t;
+	const auto minmax = std::minmax_element(frameTimes.begin(), frameTimes.end());
+	const auto average = total / frameTimes.size();
 
+	std::cout << "Spheres: " << gSpheresCollisionInfo.Size()
+		<< " (" << gSpheresCollisionInfo.NumMoving() << " moving, " << gSettings.mNumSpheres - gSpheresCollisionInfo.Size() << " removed)"
+		<< ", threads: " << gTaskScheduler->NumThreads() << ", frames: " << frameTimes.size()
+		<< ", broadphase: " << BroadphaseName(gSettings.mBroadphase) << "\n";
+	std::cout << "UpdateSpheres total: " << total << " [ms], average: " << average
+		<< " [ms], min: " << *minmax.first << " [ms], max: " << *minmax.second << " [ms]\n";
+	std::cout << "Moving spheres updated per second: " << movingUpdated / (total / 1000.0) << endl;
+
+	if (gSettings.mPrintChecksum)
+		std::cout << "Checksum: " << std::hex << StateChecksum() << std::dec << endl;
+}
+
+#endif
 
 
-void main()
+int main(int argc, char** argv)
 {
+	if (!ParseCommandLine(argc, argv, gSettings)) return 1;
 
-	srand(time(0));
+	srand(gSettings.mSeed ? gSettings.mSeed : static_cast<uint32_t>(time(0)));
 	cin.tie(NULL);
 	ios_base::sync_with_stdio(false);
 
-	gGrid = new Grid();
+	// Only the broadphase in use is created, the grids are sized on the world and the hash grid is meant for worlds
+	// too large for them
+	switch (gSettings.mBroadphase)
+	{
+	case EBroadphase::Grid:          gGrid = new Grid(); break;
+	case EBroadphase::CompactGrid:   gCompactGrid = new CompactGrid(); break;
+	case EBroadphase::HashGrid:      gHashGrid = new HashGrid(); break;
+	case EBroadphase::SweepAndPrune: gSweepAndPrune = new SweepAndPrune(); break;
+	case EBroadphase::AABBTree:      gAABBTree = new AABBTree(); break;
+	case EBroadphase::LooseTree:     gLooseTree = new LooseTree(); break;
+	}
+	gBlockerBVH = new BlockerBVH();
 
 	//---------------------------------------------------------------------------------------------------------------------
 
 	//*********************************************************
-	// Start worker threads
-	mNumWorkers = std::thread::hardware_concurrency(); // Gives a hint about level of thread concurrency supported by system (0 means no hint given)
-	if (mNumWorkers == 0) mNumWorkers = 8;
-	--mNumWorkers; // Decrease by one because this main thread is already running
-	for (uint32_t i = 0; i < mNumWorkers; ++i)
-	{
-		// Start each worker thread running the work method. Note the way to construct std::thread to run a member function
-		mUpdateSpheresWorkers[i].first.thread = std::thread(&UpdateThread, i);
-	}
+	// Start worker threads, one less than the threads used as this main thread also runs tasks
+	gTaskScheduler = new TaskScheduler();
+	gTaskScheduler->Start(gSettings.mNumThreads - 1);
+
+	totalTime = gSettings.mTimeStep;
 
 
 #ifdef _VISUALIZATION_ON
@@ -350,77 +633,57 @@ void main()
 
 	SceneSetup();
 
-#else
-
-	SceneSetup();
-
-	while (true)
+	// The main game loop, repeat until engine is stopped
+	while (myEngine->IsRunning())
 	{
-#endif
+		// Time since the last frame started: the update of the last frame, then the drawing of this one
+		frameTime = myEngine->Timer();
+		const auto elapsed = frameTime + renderingTime + workTime;
 
-#ifdef _VISUALIZATION_ON
-		// The main game loop, repeat until engine is stopped
-		while (myEngine->IsRunning())
-#else
-		//for (int i = 0; i < 10000; ++i)
-		//while(1)
-
-		auto begin = chrono::steady_clock::now();
-#endif
-		{
+		font->Draw(" Number Spheres " + std::to_string(gSpheresCollisionInfo.Size()), 10, 0);
+		font->Draw("ms: " + std::to_string(elapsed * 1000.f), 10, 10);
+		font->Draw("FPS: " + std::to_string(1.0f / elapsed), 10, 20);
+		font->Draw("Work time: " + std::to_string(workTime), 10, 30);
+		font->Draw("Render time: " + std::to_string(renderingTime), 10, 40);
+		font->Draw("Multi threading: " + std::string(bUsingMultithreading ? "Yes" : "No"), 10, 50);
 
+		// Draw the scene
+		myEngine->DrawScene();
 
-#ifdef _VISUALIZATION_ON
+		renderingTime = myEngine->Timer();
 
-			frameTime = myEngine->Timer();
-			font->Draw(" Number Spheres " + std::to_string(KNumOfSpheres), 10, 0);
-			font->Draw("ms: " + std::to_string(totalTime), 10, 10);
-			font->Draw("FPS: " + std::to_string(1.0f / totalTime), 10, 20);
-			font->Draw("Work time: " + std::to_string(workTime), 10, 30);
-			font->Draw("Render time: " + std::to_string(renderingTime), 10, 40);
-			font->Draw("Multi threading: " + std::string(bUsingMultithreading ? "Yes" : "No"), 10, 50);
+		/**** Update your scene each frame here ****/
 
-			// Draw the scene
-			myEngine->DrawScene();
-
-			renderingTime = myEngine->Timer();
-#endif
-			/**** Update your scene each frame here ****/
+		if (!GameLoop(elapsed)) break;
+	}
 
-			if (!GameLoop()) break;
+	// Delete the 3D engine now we are finished with it
+	myEngine->Delete();
 
-#ifdef _LOG
-			PrintLog();
-#endif
+#else
 
+	SceneSetup();
 
-			if (totalTime < 0) totalTime = frameTime + renderingTime + workTime;
+	bUsingMultithreading = gTaskScheduler->NumThreads() > 1;
 
-			static float t = .1f;
-			if (t < 0.f)
-			{
-				totalTime = frameTime + renderingTime + workTime;
-				t = .1f;
-			}
-			else t -= totalTime;
-		}
+	RunHeadless();
 
-#ifdef _VISUALIZATION_ON
-		// Delete the 3D engine now we are finished with it
-		myEngine->Delete();
-#else
-		auto end = chrono::steady_clock::now();
-		std::cout << "Time took = " << chrono::duration_cast<chrono::milliseconds>(end - begin).count() << "[ms]" << endl;
+#endif
 
+	// Writes the frames still queued before the log is closed
+	delete gLogWriter;
 
-	}
-#endif
-	for (uint32_t i = 0; i < mNumWorkers; ++i)
-	{
-		// Start each worker thread running the work method. Note the way to construct std::thread to run a member function
-		mUpdateSpheresWorkers[i].first.thread.detach();
-	}
+	// Wake up the worker threads so they can leave their loop
+	gTaskScheduler->Stop();
+	delete gTaskScheduler;
 
 	delete gGrid;
-
+	delete gCompactGrid;
+	delete gHashGrid;
+	delete gSweepAndPrune;
+	delete gBlockerBVH;
+	delete gAABBTree;
+	delete gLooseTree;
+
+	return 0;
 }
@@ -0,0 +1,587 @@
+// Benchmark.cpp: Micro-benchmarks for the collision kernels and the grid operations in Collision.h
+
+#define _COUNT_PAIR_TESTS
+
+#include "Collision.h"
+#include "TaskScheduler.h"
+
+#include <numeric>
+#include <random>
+#include <sstream>
+
+//---------------------------------------------------------------
+// Settings
+//---------------------------------------------------------------
+
+struct SBenchmarkSettings
+{
+	std::vector<uint32_t> mSizes = { 1000, 10000, 100000, 1000000 };	// Total number of spheres, half of them moving
+	uint32_t mMaxThreads = 0;		// Thread counts are doubled from 1 up to this, 0 means hardware concurrency
+	uint32_t mSeed = 42;
+	uint32_t mRepeats = 3;			// Every measure is repeated and the fastest run is reported
+	uint32_t mLinearQueries = 1000;	// Number of spheres queried by the O(N) kernels (brute force and line sweep)
+};
+
+SBenchmarkSettings gBenchmarkSettings;
+
+volatile uintptr_t gSink;
+
+struct SResult
+{
+	double   mSeconds = 0.0;
+	uint64_t mOperations = 0;
+	uint64_t mPairTests = 0;
+};
+
+
+bool ParseBenchmarkCommandLine(int argc, char** argv)
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		const std::string arg = argv[i];
+		if (arg == "--help" || arg == "-h" || i + 1 >= argc)
+		{
+			std::cout << "Usage: " << argv[0] << " [options]\n"
+				<< "  --sizes N,N,...   total number of spheres of each scene\n"
+				<< "  --threads N       highest thread count measured, 0 = hardware concurrency\n"
+				<< "  --seed N          seed for the scenes\n"
+				<< "  --repeats N       runs of every measure, the fastest is reported\n"
+				<< "  --queries N       spheres queried by the brute force and line sweep kernels\n"
+				<< "  --range R, --radius R, --velocity V, --clusters N, --cluster-radius R, --partitions N, --cell-size S,\n"
+				<< "  --hash-cell-size S as in the simulation\n";
+			return false;
+		}
+
+		const char* value = argv[++i];
+		if (arg == "--sizes")
+		{
+			gBenchmarkSettings.mSizes.clear();
+			std::stringstream list(value);
+			std::string size;
+			while (std::getline(list, size, ',')) gBenchmarkSettings.mSizes.push_back(strtoul(size.c_str(), nullptr, 10));
+		}
+		else if (arg == "--threads") gBenchmarkSettings.mMaxThreads = strtoul(value, nullptr, 10);
+		else if (arg == "--seed")    gBenchmarkSettings.mSeed = strtoul(value, nullptr, 10);
+		else if (arg == "--repeats") gBenchmarkSettings.mRepeats = std::max(1ul, strtoul(value, nullptr, 10));
+		else if (arg == "--queries") gBenchmarkSettings.mLinearQueries = std::max(1ul, strtoul(value, nullptr, 10));
+		else if (arg.compare(0, 2, "--") != 0 || !ParseSetting(arg.substr(2), value, gSettings))
+		{
+			std::cerr << "Unknown option " << arg << "\n";
+			return false;
+		}
+	}
+
+	if (!ValidateSettings(gSettings)) return false;
+
+	if (gBenchmarkSettings.mMaxThreads == 0) gBenchmarkSettings.mMaxThreads = std::max(1u, std::thread::hardware_concurrency());
+	return true;
+}
+
+
+//---------------------------------------------------------------
+// Scene generation
+//---------------------------------------------------------------
+
+struct SRandomSphere
+{
+	CVector mPosition;
+	CVector mVelocity;
+	float   mRadius;
+};
+
+// Same distribution as SceneSetup(), but independent from rand() so every size gets the same sequence for a seed
+SRandomSphere RandomSphere(std::mt19937& rng, const std::vector<CVector>& clusters)
+{
+	std::uniform_real_distribution<float> unit(-1.f, 1.f);
+	std::uniform_real_distribution<float> radius(0.5f, gSettings.mRangeRadius);
+
+	SRandomSphere s;
+	s.mRadius = radius(rng);
+#ifdef _3D
+	s.mVelocity = CVector3(unit(rng), unit(rng), unit(rng)) * gSettings.mRangeVelocity;
+	s.mPosition = CVector3(unit(rng), unit(rng), unit(rng));
+#else
+	s.mVelocity = CVector2(unit(rng), unit(rng)) * gSettings.mRangeVelocity;
+	s.mPosition = CVector2(unit(rng), unit(rng));
+#endif
+	if (clusters.empty())
+		s.mPosition = s.mPosition * (gSettings.mRangeSpawn - s.mRadius);
+	else
+		s.mPosition = clusters[std::uniform_int_distribution<size_t>(0, clusters.size() - 1)(rng)] + s.mPosition * gSettings.mClusterRadius;
+	return s;
+}
+
+void BuildBroadphases();
+
+void GenerateScene(uint32_t numSpheres)
+{
+	std::mt19937 rng(gBenchmarkSettings.mSeed);
+
+	std::uniform_real_distribution<float> unit(-1.f, 1.f);
+	std::vector<CVector> clusters(gSettings.mNumClusters);
+	for (auto& centre : clusters)
+	{
+#ifdef _3D
+		centre = CVector3(unit(rng), unit(rng), unit(rng)) * (gSettings.mRangeSpawn - gSettings.mClusterRadius);
+#else
+		centre = CVector2(unit(rng), unit(rng)) * (gSettings.mRangeSpawn - gSettings.mClusterRadius);
+#endif
+	}
+
+	std::vector<SRandomSphere> blocking(numSpheres / 2);
+	std::vector<SRandomSphere> moving(numSpheres / 2);
+	for (auto& s : blocking) s = RandomSphere(rng, clusters);
+	for (auto& s : moving) s = RandomSphere(rng, clusters);
+
+	gSettings.mNumSpheres = numSpheres;
+
+	auto& spheres = gSpheresCollisionInfo;
+	spheres.Clear();
+	spheres.Reserve(numSpheres);
+	for (const auto& s : blocking) spheres.Add(s.mPosition, s.mVelocity, s.mRadius, true);
+	for (const auto& s : moving) spheres.Add(s.mPosition, s.mVelocity, s.mRadius, false);
+	gSpheres.assign(numSpheres, SSphere());
+	gSphereHandles.Clear();
+	for (uint32_t s = 0; s != numSpheres; ++s) gSpheres[s].mHandle = gSphereHandles.Create(s);
+
+	BuildBroadphases();
+}
+
+// Builds every broadphase from the spheres of the store
+void BuildBroadphases()
+{
+	const auto& spheres = gSpheresCollisionInfo;
+
+	delete gGrid;
+	gGrid = new Grid();
+	for (auto i = 0u; i < spheres.Size(); ++i) gGrid->Add(i);
+
+	delete gCompactGrid;
+	gCompactGrid = new CompactGrid();
+	gCompactGrid->Build();
+
+	delete gHashGrid;
+	gHashGrid = new HashGrid();
+	gHashGrid->Build();
+
+	delete gSweepAndPrune;
+	gSweepAndPrune = new SweepAndPrune();
+	gSweepAndPrune->Build();
+
+	delete gBlockerBVH;
+	gBlockerBVH = new BlockerBVH();
+	gBlockerBVH->Build();
+
+	delete gAABBTree;
+	gAABBTree = new AABBTree();
+	gAABBTree->Build();
+
+	delete gLooseTree;
+	gLooseTree = new LooseTree();
+	gLooseTree->Build();
+}
+
+
+//---------------------------------------------------------------
+// Measures
+//---------------------------------------------------------------
+
+template<typename Function>
+double Seconds(Function function)
+{
+	const auto begin = chrono::steady_clock::now();
+	function();
+	return chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+}
+
+// Query numQueries moving spheres, spread evenly over the array, split between numThreads threads
+template<typename Kernel>
+SResult RunQueries(Kernel kernel, uint32_t numQueries, uint32_t numThreads)
+{
+	const auto numSpheres = gSpheresCollisionInfo.NumMoving();
+	const auto firstMoving = gSpheresCollisionInfo.mNumBlocking;
+	numQueries = std::min(numQueries, numSpheres);
+	const auto stride = numSpheres / numQueries;
+
+	std::vector<uint64_t> pairTests(numThreads, 0);
+	std::vector<uint64_t> hits(numThreads, 0);
+
+	auto work = [&](uint32_t thread)
+	{
+		gPairTests = 0;
+		const auto start = numQueries * thread / numThreads;
+		const auto end = numQueries * (thread + 1) / numThreads;
+		for (auto i = start; i < end; ++i)
+		{
+			CVector surfaceNormal;
+			if (kernel(firstMoving + i * stride, surfaceNormal) != KNoCollision) ++hits[thread];
+		}
+		pairTests[thread] = gPairTests;
+	};
+
+	SResult result;
+	result.mSeconds = Seconds([&]()
+	{
+		std::vector<std::thread> threads;
+		for (uint32_t t = 1; t < numThreads; ++t) threads.emplace_back(work, t);
+		work(0);
+		for (auto& t : threads) t.join();
+	});
+	result.mOperations = numQueries;
+	result.mPairTests = std::accumulate(pairTests.begin(), pairTests.end(), uint64_t(0));
+	return result;
+}
+
+template<typename Measure>
+SResult Best(Measure measure)
+{
+	SResult best;
+	for (uint32_t r = 0; r < gBenchmarkSettings.mRepeats; ++r)
+	{
+		const auto result = measure();
+		if (r == 0 || result.mSeconds < best.mSeconds) best = result;
+	}
+	return best;
+}
+
+void Print(const char* name, uint32_t numSpheres, uint32_t numThreads, const SResult& result, double baseSeconds)
+{
+	const auto nsPerSphere = result.mSeconds * 1e9 / result.mOperations;
+	const auto pairTestsPerSecond = result.mPairTests / result.mSeconds;
+
+	std::cout.width(32);  std::cout << std::left << name << std::right;
+	std::cout.width(10);  std::cout << numSpheres;
+	std::cout.width(8);   std::cout << numThreads;
+	std::cout.width(10);  std::cout << result.mOperations;
+	std::cout.width(14);  std::cout << nsPerSphere;
+	std::cout.width(16);  std::cout << pairTestsPerSecond;
+	std::cout.width(10);  std::cout << (baseSeconds > 0.0 ? baseSeconds / result.mSeconds : 1.0) << "\n";
+}
+
+template<typename Kernel>
+void BenchmarkKernel(const char* name, Kernel kernel, uint32_t numSpheres, uint32_t numQueries)
+{
+	double baseSeconds = 0.0;
+	for (uint32_t threads = 1; threads <= gBenchmarkSettings.mMaxThreads; threads *= 2)
+	{
+		const auto result = Best([&]() { return RunQueries(kernel, numQueries, threads); });
+		if (threads == 1) baseSeconds = result.mSeconds;
+		Print(name, numSpheres, threads, result, baseSeconds);
+	}
+}
+
+using FindContactsFunction = void (*)(uint32_t first, uint32_t last, std::vector<SContact>& contacts);
+
+// Calls findContacts once over [first, last), split between numThreads threads
+SResult RunFindContacts(FindContactsFunction findContacts, uint32_t first, uint32_t last, uint32_t numThreads)
+{
+	std::vector<uint64_t> pairTests(numThreads, 0);
+
+	auto work = [&](uint32_t thread)
+	{
+		gPairTests = 0;
+		gContacts[thread].clear();
+		findContacts(first + (last - first) * thread / numThreads, first + (last - first) * (thread + 1) / numThreads, gContacts[thread]);
+		pairTests[thread] = gPairTests;
+	};
+
+	SResult result;
+	result.mSeconds = Seconds([&]()
+	{
+		std::vector<std::thread> threads;
+		for (uint32_t t = 1; t < numThreads; ++t) threads.emplace_back(work, t);
+		work(0);
+		for (auto& t : threads) t.join();
+	});
+	result.mOperations = gSpheresCollisionInfo.Size();
+	result.mPairTests = std::accumulate(pairTests.begin(), pairTests.end(), uint64_t(0));
+	return result;
+}
+
+void BenchmarkFindContacts(const char* name, FindContactsFunction findContacts, uint32_t first, uint32_t last, uint32_t numSpheres)
+{
+	double baseSeconds = 0.0;
+	for (uint32_t threads = 1; threads <= std::min(gBenchmarkSettings.mMaxThreads, MAX_WORKERS + 1); threads *= 2)
+	{
+		const auto result = Best([&]() { return RunFindContacts(findContacts, first, last, threads); });
+		if (threads == 1) baseSeconds = result.mSeconds;
+		Print(name, numSpheres, threads, result, baseSeconds);
+	}
+}
+
+// Finds all the contacts of the scene with one broadphase
+void BenchmarkFindContacts(const char* name, EBroadphase broadphase, uint32_t numSpheres)
+{
+	gSettings.mBroadphase = broadphase;
+	BenchmarkFindContacts(name, FindContacts, 0, NumBroadphasePartitions(), numSpheres);
+}
+
+// Sweeps the moving spheres over one frame against the candidates of the grid, as in continuous mode
+void BenchmarkFindImpacts(uint32_t numSpheres)
+{
+	totalTime = gSettings.mTimeStep;
+	gSweptMargin = MaxSweptDistance();
+	gSettings.mBroadphase = EBroadphase::Grid;
+	BenchmarkFindContacts("FindImpacts (grid)", FindImpacts, gSpheresCollisionInfo.mNumBlocking, gSpheresCollisionInfo.Size(), numSpheres);
+}
+
+void BenchmarkGrid(uint32_t numSpheres)
+{
+	auto& spheres = gSpheresCollisionInfo;
+	const auto firstMoving = spheres.mNumBlocking;
+	const auto numMoving = spheres.NumMoving();
+
+	// Add and RemoveFromPartition work on a grid holding only the moving spheres
+	Print("Grid::Add", numSpheres, 1, Best([&]()
+	{
+		delete gGrid;
+		gGrid = new Grid();
+		SResult result;
+		result.mSeconds = Seconds([&]() { for (auto i = firstMoving; i < spheres.Size(); ++i) gGrid->Add(i); });
+		result.mOperations = numMoving;
+		return result;
+	}), 0.0);
+
+	// Remove in a scattered order, so the swap with the last element of the partition is exercised
+	std::vector<uint32_t> order(numMoving);
+	std::iota(order.begin(), order.end(), firstMoving);
+	std::shuffle(order.begin(), order.end(), std::mt19937(gBenchmarkSettings.mSeed));
+
+	Print("Grid::RemoveFromPartition", numSpheres, 1, Best([&]()
+	{
+		delete gGrid;
+		gGrid = new Grid();
+		for (auto i = firstMoving; i < spheres.Size(); ++i) gGrid->Add(i);
+		SResult result;
+		result.mSeconds = Seconds([&]() { for (const auto i : order) gGrid->RemoveFromPartition(i); });
+		result.mOperations = numMoving;
+		return result;
+	}), 0.0);
+
+	uintptr_t checksum = 0;
+	Print("Grid::GetPartition", numSpheres, 1, Best([&]()
+	{
+		SResult result;
+		result.mSeconds = Seconds([&]()
+		{
+			for (auto i = firstMoving; i < spheres.Size(); ++i) checksum += reinterpret_cast<uintptr_t>(gGrid->GetPartition(spheres.Position(i)));
+		});
+		result.mOperations = numMoving;
+		return result;
+	}), 0.0);
+
+	float sum = 0.f;
+	Print("Reflect", numSpheres, 1, Best([&]()
+	{
+		SResult result;
+		result.mSeconds = Seconds([&]()
+		{
+			for (auto i = firstMoving; i < spheres.Size(); ++i) sum += Reflect(spheres.Velocity(i), spheres.Position(i)).x;
+		});
+		result.mOperations = numMoving;
+		return result;
+	}), 0.0);
+
+	Print("CompactGrid::Build", numSpheres, 1, Best([&]()
+	{
+		SResult result;
+		result.mSeconds = Seconds([&]() { gCompactGrid->Build(); });
+		result.mOperations = spheres.Size();
+		return result;
+	}), 0.0);
+
+	Print("HashGrid::Build", numSpheres, 1, Best([&]()
+	{
+		SResult result;
+		result.mSeconds = Seconds([&]() { gHashGrid->Build(); });
+		result.mOperations = spheres.Size();
+		return result;
+	}), 0.0);
+
+	Print("BlockerBVH::Build", numSpheres, 1, Best([&]()
+	{
+		SResult result;
+		result.mSeconds = Seconds([&]() { gBlockerBVH->Build(); });
+		result.mOperations = spheres.mNumBlocking;
+		return result;
+	}), 0.0);
+
+	Print("AABBTree::Build", numSpheres, 1, Best([&]()
+	{
+		SResult result;
+		result.mSeconds = Seconds([&]() { gAABBTree->Build(); });
+		result.mOperations = spheres.Size();
+		return result;
+	}), 0.0);
+
+	Print("LooseTree::Build", numSpheres, 1, Best([&]()
+	{
+		SResult result;
+		result.mSeconds = Seconds([&]() { gLooseTree->Build(); });
+		result.mOperations = spheres.Size();
+		return result;
+	}), 0.0);
+
+	// Update the broadphases after the spheres moved for some frames, the scene is restored after every run
+	const auto updateAfterFrames = [&](const char* name, uint32_t frames, auto update)
+	{
+		const auto positions = spheres;
+		Print(name, numSpheres, 1, Best([&]()
+		{
+			for (auto i = firstMoving; i < spheres.Size(); ++i) spheres.SetPosition(i, spheres.Position(i) + spheres.Velocity(i) * (gSettings.mTimeStep * frames));
+			SResult result;
+			result.mSeconds = Seconds(update);
+			result.mOperations = numMoving;
+			spheres = positions;
+			update();
+			return result;
+		}), 0.0);
+	};
+	updateAfterFrames("SweepAndPrune::Update", 1, [&]() { gSweepAndPrune->Update(); });
+	updateAfterFrames("AABBTree::Update (1 frame)", 1, [&]() { gAABBTree->Update(); });
+	updateAfterFrames("AABBTree::Update (10 frames)", 10, [&]() { gAABBTree->Update(); });
+	updateAfterFrames("LooseTree migrations (1 frame)", 1, [&]()
+	{
+		for (auto i = firstMoving; i < spheres.Size(); ++i)
+		{
+			if (!gLooseTree->LeftNode(i)) continue;
+			gLooseTree->Remove(i);
+			gLooseTree->Add(i);
+		}
+	});
+
+	// Keep the results alive so the loops are not optimised away
+	gSink = checksum + static_cast<uintptr_t>(sum);
+}
+
+
+// Sorts the moving spheres along a Morton curve and finds the contacts again with the broadphases holding sphere
+// indices, which scan the store in the order of their lists. The scene is left sorted
+void BenchmarkReorder(uint32_t numSpheres)
+{
+	auto& spheres = gSpheresCollisionInfo;
+
+	// The broadphases are all built again after the sort, none needs to be renumbered
+	gSettings.mBroadphase = EBroadphase::CompactGrid;
+
+	const auto unsorted = spheres;
+	Print("ReorderSpheres", numSpheres, 1, Best([&]()
+	{
+		spheres = unsorted;
+		SResult result;
+		result.mSeconds = Seconds([&]() { ReorderSpheres(spheres.mNumBlocking, spheres.Size()); });
+		result.mOperations = spheres.NumMoving();
+		return result;
+	}), 0.0);
+
+	BuildBroadphases();
+	BenchmarkFindContacts("FindContactsGrid (Morton)", EBroadphase::Grid, numSpheres);
+	BenchmarkFindContacts("FindContactsSAP (Morton)", EBroadphase::SweepAndPrune, numSpheres);
+	BenchmarkFindContacts("FindContactsLooseTree (Morton)", EBroadphase::LooseTree, numSpheres);
+}
+
+
+// Time from the start of a ParallelFor to the first chunk run by every thread, written by each thread in its own slot
+// A thread that found all the chunks taken before it woke up keeps 0
+chrono::steady_clock::time_point gParallelForStart;
+uint64_t gWakeCall[MAX_WORKERS + 1];
+double gWakeSeconds[MAX_WORKERS + 1];
+uint64_t gCall;
+
+void EmptyTask(uint32_t, uint32_t, uint32_t) {}
+
+void WakeTask(uint32_t thread, uint32_t, uint32_t)
+{
+	if (gWakeCall[thread] == gCall) return;
+	gWakeCall[thread] = gCall;
+	gWakeSeconds[thread] = chrono::duration<double>(chrono::steady_clock::now() - gParallelForStart).count();
+}
+
+// Round trip of an empty ParallelFor, and latency until the last thread starts working, with the workers still
+// spinning from the previous call and with the workers parked after a pause
+void BenchmarkScheduler()
+{
+	constexpr uint32_t KCalls = 10000;
+	constexpr uint32_t KParkedCalls = 200;
+
+	bUsingMultithreading = true;
+	for (uint32_t threads = 2; threads <= std::min(gBenchmarkSettings.mMaxThreads, MAX_WORKERS + 1); threads *= 2)
+	{
+		TaskScheduler scheduler;
+		scheduler.Start(threads - 1);
+		const auto numChunks = threads * TaskScheduler::KChunksPerThread;
+
+		Print("ParallelFor round trip", 0, threads, Best([&]()
+		{
+			SResult result;
+			result.mSeconds = Seconds([&]() { for (uint32_t c = 0; c < KCalls; ++c) scheduler.ParallelFor(0, numChunks, EmptyTask); });
+			result.mOperations = KCalls;
+			return result;
+		}), 0.0);
+
+		const auto wakeLatency = [&](uint32_t calls, chrono::microseconds pause)
+		{
+			SResult result;
+			for (uint32_t c = 0; c < calls; ++c)
+			{
+				if (pause.count() > 0) std::this_thread::sleep_for(pause);
+				++gCall;
+				std::fill(gWakeSeconds, gWakeSeconds + threads, 0.0);
+				gParallelForStart = chrono::steady_clock::now();
+				scheduler.ParallelFor(0, numChunks, WakeTask);
+				result.mSeconds += *std::max_element(gWakeSeconds, gWakeSeconds + threads);
+			}
+			result.mOperations = calls;
+			return result;
+		};
+		Print("ParallelFor wake (spinning)", 0, threads, Best([&]() { return wakeLatency(KCalls, chrono::microseconds(0)); }), 0.0);
+		Print("ParallelFor wake (parked)", 0, threads, Best([&]() { return wakeLatency(KParkedCalls, chrono::microseconds(2000)); }), 0.0);
+
+		scheduler.Stop();
+	}
+	bUsingMultithreading = false;
+}
+
+
+int main(int argc, char** argv)
+{
+	if (!ParseBenchmarkCommandLine(argc, argv)) return 1;
+
+	std::cout << "Kernel                              Spheres Threads   Queries     ns/sphere    Pair tests/s   Speedup\n";
+
+	BenchmarkScheduler();
+
+	for (const auto numSpheres : gBenchmarkSettings.mSizes)
+	{
+		GenerateScene(numSpheres);
+
+		const auto allSpheres = numSpheres / 2;
+
+		BenchmarkKernel("CollisionSpatialPartitioning", CollisionSpatialPartitioning<CVector>, numSpheres, allSpheres);
+		BenchmarkKernel("CollisionCompactGrid", CollisionCompactGrid<CVector>, numSpheres, allSpheres);
+		BenchmarkFindContacts("FindContactsGrid", EBroadphase::Grid, numSpheres);
+		BenchmarkFindContacts("FindContactsCompactGrid", EBroadphase::CompactGrid, numSpheres);
+		BenchmarkFindContacts("FindContactsHashGrid", EBroadphase::HashGrid, numSpheres);
+		BenchmarkFindContacts("FindContactsSweepAndPrune", EBroadphase::SweepAndPrune, numSpheres);
+		BenchmarkFindContacts("FindContactsAABBTree", EBroadphase::AABBTree, numSpheres);
+		BenchmarkFindContacts("FindContactsLooseTree", EBroadphase::LooseTree, numSpheres);
+		BenchmarkFindContacts("FindContactsBlockerBVH", FindContactsBlockerBVH, gSpheresCollisionInfo.mNumBlocking, gSpheresCollisionInfo.Size(), numSpheres);
+		BenchmarkFindImpacts(numSpheres);
+#ifndef _3D
+		const auto linearQueries = gBenchmarkSettings.mLinearQueries;
+		BenchmarkKernel("CollisionLineSweep", CollisionLineSweep<CVector>, numSpheres, linearQueries);
+		BenchmarkKernel("Collision (brute force)", Collision<CVector>, numSpheres, linearQueries);
+#endif
+		BenchmarkGrid(numSpheres);
+		BenchmarkReorder(numSpheres);
+	}
+
+	delete gGrid;
+	delete gCompactGrid;
+	delete gHashGrid;
+	delete gSweepAndPrune;
+	delete gBlockerBVH;
+	delete gAABBTree;
+	delete gLooseTree;
+	return 0;
+}
@@ -0,0 +1,225 @@
+#pragma once
+
+#include "AABB.h"
+
+#include <limits>
+
+// Bounding volume hierarchy over the blocking spheres, built once at the end of SceneSetup() as they never move
+// The nodes are stored depth first in one array: the left child of a node is the next node and only the right one
+// is stored. A leaf holds up to KLeafSize spheres, contiguous in mSpheres, and their positions and radii are copied in
+// the same order so a leaf is scanned as one span of the compact grid
+// The boxes are grown by the collision range of the spheres (radius times KCollisionRangeScale), so a moving sphere
+// can only collide with the spheres of the leaves its own grown box overlaps
+class BlockerBVH
+{
+
+public:
+
+	static constexpr uint32_t KLeafSize = 16;
+
+	struct SNode
+	{
+		SAABB    mBox;
+		uint32_t mFirst;	// Leaf: first sphere in mSpheres, otherwise the right child
+		uint32_t mCount;	// Number of spheres of a leaf, 0 for the other nodes
+	};
+
+	std::vector<SNode> mNodes;
+	// In leaf order
+	std::vector<uint32_t> mSpheres;		// Index of the blocking spheres in gSpheresCollisionInfo
+	std::vector<float> mPositionX;
+	std::vector<float> mPositionY;
+#ifdef _3D
+	std::vector<float> mPositionZ;
+#endif
+	std::vector<float> mRadius;
+
+
+	// Builds the hierarchy over the blocking spheres of the store, splitting every node at the median of its longest axis
+	void Build()
+	{
+		const auto numBlocking = gSpheresCollisionInfo.mNumBlocking;
+
+		mSpheres.resize(numBlocking);
+		for (uint32_t i = 0; i < numBlocking; ++i) mSpheres[i] = i;
+
+		mNodes.clear();
+		mNodes.reserve(2 * (numBlocking / KLeafSize + 1));
+		if (numBlocking > 0) BuildNode(0, numBlocking);
+
+		const auto& spheres = gSpheresCollisionInfo;
+		mPositionX.resize(numBlocking);
+		mPositionY.resize(numBlocking);
+#ifdef _3D
+		mPositionZ.resize(numBlocking);
+#endif
+		mRadius.resize(numBlocking);
+		for (uint32_t k = 0; k < numBlocking; ++k)
+		{
+			const auto s = mSpheres[k];
+			mPositionX[k] = spheres.mPositionX[s];
+			mPositionY[k] = spheres.mPositionY[s];
+#ifdef _3D
+			mPositionZ[k] = spheres.mPositionZ[s];
+#endif
+			mRadius[k] = spheres.mRadius[s];
+		}
+	}
+
+	// Calls collided(other, surfaceNormal) for the blocking spheres hit by the sphere, until it returns true
+	template<typename Collided>
+	bool Query(uint32_t sphere, Collided collided) const
+	{
+		if (mNodes.empty()) return false;
+
+		const auto& spheres = gSpheresCollisionInfo;
+		const auto radius = spheres.mRadius[sphere];
+		const auto position = spheres.Position(sphere);
+		const auto box = SAABB::OfSphere(sphere);
+#ifdef _3D
+		const auto z = position.z;
+#else
+		const auto z = 0.f;
+#endif
+
+		// The hierarchy is balanced, 64 levels are never reached
+		uint32_t stack[64];
+		uint32_t top = 0;
+		stack[top++] = 0;
+
+		while (top > 0)
+		{
+			const auto& node = mNodes[stack[--top]];
+
+			if (!box.Overlaps(node.mBox)) continue;
+
+			if (node.mCount > 0)
+			{
+				if (ForEachCollisionInSpan(*this, sphere, position.x, position.y, z, radius, node.mFirst, node.mFirst + node.mCount, collided)) return true;
+			}
+			else
+			{
+				stack[top++] = node.mFirst;
+				stack[top++] = static_cast<uint32_t>(&node - mNodes.data()) + 1;
+			}
+		}
+		return false;
+	}
+
+	// Calls visit(other) for the blocking spheres of all the leaves whose box overlaps the box
+	template<typename Visit>
+	void QueryBox(const SAABB& box, Visit visit) const
+	{
+		if (mNodes.empty()) return;
+
+		uint32_t stack[64];
+		uint32_t top = 0;
+		stack[top++] = 0;
+
+		while (top > 0)
+		{
+			const auto& node = mNodes[stack[--top]];
+
+			if (!box.Overlaps(node.mBox)) continue;
+
+			if (node.mCount > 0)
+			{
+				for (auto k = node.mFirst; k != node.mFirst + node.mCount; ++k) visit(mSpheres[k]);
+			}
+			else
+			{
+				stack[top++] = node.mFirst;
+				stack[top++] = static_cast<uint32_t>(&node - mNodes.data()) + 1;
+			}
+		}
+	}
+
+	// Drops the blocking spheres removed by SSphereStore::SwapRemoveOrder from their leaf and renames the others
+	// The boxes are not shrunk, they still contain the spheres left. A leaf left empty gets a box that overlaps nothing
+	void Compact(const std::vector<uint32_t>& newIndex)
+	{
+		for (auto& node : mNodes)
+		{
+			if (node.mCount == 0) continue;
+
+			auto n = node.mFirst;
+			for (auto k = node.mFirst; k != node.mFirst + node.mCount; ++k)
+			{
+				if (newIndex[mSpheres[k]] == SSphereStore::KRemoved) continue;
+				mSpheres[n] = newIndex[mSpheres[k]];
+				mPositionX[n] = mPositionX[k];
+				mPositionY[n] = mPositionY[k];
+#ifdef _3D
+				mPositionZ[n] = mPositionZ[k];
+#endif
+				mRadius[n] = mRadius[k];
+				++n;
+			}
+			node.mCount = n - node.mFirst;
+
+			// The queries test the box before the count, the node is never taken for one with children
+			if (node.mCount == 0)
+			{
+				const auto big = std::numeric_limits<float>::max();
+#ifdef _3D
+				node.mBox = { CVector3(big, big, big), CVector3(-big, -big, -big) };
+#else
+				node.mBox = { CVector2(big, big), CVector2(-big, -big) };
+#endif
+			}
+		}
+	}
+
+private:
+
+	// Builds the node of the spheres [first, last) of mSpheres and its children, returns the index of the node
+	uint32_t BuildNode(uint32_t first, uint32_t last)
+	{
+		const auto& spheres = gSpheresCollisionInfo;
+
+		const auto index = static_cast<uint32_t>(mNodes.size());
+		mNodes.emplace_back();
+
+		// Box of the grown spheres, and box of their centres to choose the axis to split
+		auto box = SAABB::OfSphere(mSpheres[first]);
+		SAABB centres{ spheres.Position(mSpheres[first]), spheres.Position(mSpheres[first]) };
+		for (auto i = first + 1; i != last; ++i)
+		{
+			const auto centre = spheres.Position(mSpheres[i]);
+			box = box.Union(SAABB::OfSphere(mSpheres[i]));
+			centres = centres.Union({ centre, centre });
+		}
+
+		mNodes[index].mBox = box;
+
+		if (last - first <= KLeafSize)
+		{
+			mNodes[index].mFirst = first;
+			mNodes[index].mCount = last - first;
+			return index;
+		}
+
+		const auto extent = centres.mMax - centres.mMin;
+		auto axis = extent.x >= extent.y ? 0 : 1;
+#ifdef _3D
+		if (extent.z > (axis == 0 ? extent.x : extent.y)) axis = 2;
+#endif
+		const std::vector<float>* coordinates[] = { &spheres.mPositionX, &spheres.mPositionY,
+#ifdef _3D
+			&spheres.mPositionZ,
+#endif
+		};
+		const auto& coordinate = *coordinates[axis];
+
+		const auto middle = first + (last - first) / 2;
+		std::nth_element(mSpheres.begin() + first, mSpheres.begin() + middle, mSpheres.begin() + last,
+			[&](uint32_t a, uint32_t b) { return coordinate[a] < coordinate[b]; });
+
+		BuildNode(first, middle);
+		const auto right = BuildNode(middle, last);
+
+		mNodes[index].mFirst = right;
+		mNodes[index].mCount = 0;
+		return index;
+	}
+};
@@ -1,217 +1,447 @@
 #pragma once
 
 #include "Common.h"
+#include "CompactGrid.h"
+#include "HashGrid.h"
+#include "SweepAndPrune.h"
+
+// The benchmark defines _COUNT_PAIR_TESTS to count how many sphere-sphere distance tests the kernels perform
+#ifdef _COUNT_PAIR_TESTS
+thread_local uint64_t gPairTests = 0;
+#define COUNT_PAIR_TEST() ++gPairTests
+#define COUNT_PAIR_TESTS(n) gPairTests += (n)
+#else
+#define COUNT_PAIR_TEST()
+#define COUNT_PAIR_TESTS(n)
+#endif
 
-int to1D(int x, int y, int z) {
-	return (z * KNumPartitions * KNumPartitions) + (y * KNumPartitions) + x;
-}
+// The SIMD cell scan is compiled in when the compiler targets AVX2 or AVX-512 (see ASSIGNMENT_SIMD in CMakeLists.txt)
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
+// Index of the lowest set bit, mask must not be 0
+inline uint32_t FirstSetBit(uint32_t mask)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return index;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+#endif
 
+// The partitions store the index of the spheres in gSpheresCollisionInfo
+// The grid covers the world [-mRangeSpawn, mRangeSpawn] with gSettings.mNumPartitions partitions per axis
 class Grid
 {
 
 public:
 
-	Grid()
+	Grid() :
+		mNumPartitions(static_cast<int>(gSettings.mNumPartitions)),
+		mPartitionSize(gSettings.mPartitionSize),
+		mRangeSpawn(gSettings.mRangeSpawn)
 	{
-		for (int i = 0; i < KNumPartitions * KNumPartitions; ++i)
+#ifdef _3D
+		mPartitions.resize(static_cast<size_t>(mNumPartitions) * mNumPartitions * mNumPartitions);
+#else
+		mPartitions.resize(static_cast<size_t>(mNumPartitions) * mNumPartitions);
+#endif
+		// Room for twice the average number of spheres per partition, so few of them grow while the spheres move
+		const auto reserve = 2 * gSettings.mNumSpheres / mPartitions.size() + 1;
+		for (auto& partition : mPartitions)
 		{
-			mPartitions[i].reserve(KNumPartitions * 2);
+			partition.reserve(reserve);
 		}
 	}
 
+	int mNumPartitions;
+	float mPartitionSize;
+	float mRangeSpawn;
 
-#ifdef _3D
+	std::vector<std::vector<uint32_t>> mPartitions;
 
-	std::vector<SSphereCollisionInfo*> mPartitions[KNumPartitions * KNumPartitions * KNumPartitions];
+	int to1D(int x, int y, int z) const {
+		return (z * mNumPartitions * mNumPartitions) + (y * mNumPartitions) + x;
+	}
 
-	void Add(SSphereCollisionInfo* s)
+	// Coordinate of the partition along one axis, positions outside the world are clamped to the edge partitions
+	int PartitionCoordinate(float p) const
 	{
-		auto x = static_cast<int>((s->mPosition.x + KRangeSpawn) / kPartitionSize);
-		auto y = static_cast<int>((s->mPosition.y + KRangeSpawn) / kPartitionSize);
-		auto z = static_cast<int>((s->mPosition.z + KRangeSpawn) / kPartitionSize);
+		auto c = static_cast<int>((p + mRangeSpawn) / mPartitionSize);
+		if (c >= mNumPartitions) c = mNumPartitions - 1;
+		if (c < 0) c = 0;
+		return c;
+	}
 
-		if (x >= KNumPartitions) x = KNumPartitions - 1;
-		if (y >= KNumPartitions) y = KNumPartitions - 1;
-		if (z >= KNumPartitions) z = KNumPartitions - 1;
-		if (x < 0) x = 0;
-		if (y < 0) y = 0;
-		if (z < 0) z = 0;
 
-		auto p = mPartitions[to1D(x, y, z)];
-		p.emplace_back(s);
-		s->mPartition = &p;
-	}
+#ifdef _3D
 
-	auto* GetPartition(CVector3& pos)
-	{
-		const auto x = static_cast<int>((pos.x + KRangeSpawn) / kPartitionSize);
-		const auto y = static_cast<int>((pos.y + KRangeSpawn) / kPartitionSize);
-		const auto z = static_cast<int>((pos.z + KRangeSpawn) / kPartitionSize);
+	static constexpr int KNumNeighbours = 26;
 
-		return &mPartitions[to1D(x,y,z)];
+	int PartitionIndex(const CVector3& pos) const
+	{
+		return to1D(PartitionCoordinate(pos.x), PartitionCoordinate(pos.y), PartitionCoordinate(pos.z));
 	}
 
-
 #else
 
-	std::vector<SSphereCollisionInfo*> mPartitions[KNumPartitions * KNumPartitions];
+	static constexpr int KNumNeighbours = 8;
 
-	void GetNeighboursPartitions(CVector2& pos, std::vector<SSphereCollisionInfo*>* neighbours[8])
+	// Index of the partition containing the position, positions outside the world are clamped to the edge partitions
+	int PartitionIndex(const CVector2& pos) const
 	{
+		return to1D(PartitionCoordinate(pos.x), PartitionCoordinate(pos.y), 0);
+	}
 
-		const auto x = static_cast<int>((pos.x + KRangeSpawn) / kPartitionSize);
-		const auto y = static_cast<int>((pos.y + KRangeSpawn) / kPartitionSize);
+#endif
 
-		auto n = KNumPartitions - 1;
+	// The partitions around the one containing the position (8 in 2D, 26 in 3D), nullptr for the ones outside the grid
+	void GetNeighboursPartitions(const CVector& pos, std::vector<uint32_t>* neighbours[KNumNeighbours])
+	{
+		const auto x = PartitionCoordinate(pos.x);
+		const auto y = PartitionCoordinate(pos.y);
+#ifdef _3D
+		const auto z = PartitionCoordinate(pos.z);
+		const auto dz0 = -1, dz1 = 1;
+#else
+		const auto z = 0;
+		const auto dz0 = 0, dz1 = 0;
+#endif
 
-		if (x > 0 && y > 0) neighbours[0] = &mPartitions[y - 1 * KNumPartitions + x - 1];	else neighbours[0] = nullptr;
-		if (y > 0)			neighbours[1] = &mPartitions[y - 1 * KNumPartitions + x];	else neighbours[1] = nullptr;
-		if (x < n && y > 0) neighbours[2] = &mPartitions[y - 1 * KNumPartitions + x + 1];	else neighbours[2] = nullptr;
-		if (x > 0)			neighbours[3] = &mPartitions[y * KNumPartitions + x - 1];	else neighbours[3] = nullptr;
-		if (x < n && y < n)	neighbours[4] = &mPartitions[y + 1 * KNumPartitions + x + 1];	else neighbours[4] = nullptr;
-		if (y < n)			neighbours[5] = &mPartitions[y + 1 * KNumPartitions + x];	else neighbours[5] = nullptr;
-		if (y < n && x > 0)	neighbours[6] = &mPartitions[y + 1 * KNumPartitions + x - 1];	else neighbours[6] = nullptr;
-		if (x > 0)			neighbours[7] = &mPartitions[y * KNumPartitions + x - 1];	else neighbours[7] = nullptr;
+		auto n = 0;
+		for (auto dz = dz0; dz <= dz1; ++dz)
+		{
+			for (auto dy = -1; dy <= 1; ++dy)
+			{
+				for (auto dx = -1; dx <= 1; ++dx)
+				{
+					if (dx == 0 && dy == 0 && dz == 0) continue;
 
+					const auto nx = x + dx;
+					const auto ny = y + dy;
+					const auto nz = z + dz;
+					const bool inside = nx >= 0 && nx < mNumPartitions && ny >= 0 && ny < mNumPartitions && nz >= 0 && nz < mNumPartitions;
+					neighbours[n++] = inside ? &mPartitions[to1D(nx, ny, nz)] : nullptr;
+				}
+			}
+		}
 	}
 
-	void Add(SSphereCollisionInfo* s)
+	void Add(uint32_t s)
 	{
-		
-		auto x = static_cast<int>((s->mPosition.x + KRangeSpawn) / kPartitionSize);
-		auto y = static_cast<int>((s->mPosition.y + KRangeSpawn) / kPartitionSize);
-
-		if (x >= KNumPartitions) x = KNumPartitions - 1;
-		if (y >= KNumPartitions) y = KNumPartitions - 1;
-		if (x < 0) x = 0;
-		if (y < 0) y = 0;
+		const auto index = PartitionIndex(gSpheresCollisionInfo.Position(s));
+		auto& partition = mPartitions[index];
 
-		mPartitions[y * KNumPartitions + x].emplace_back(s);
-		s->indexInPartition = mPartitions[y * KNumPartitions + x].size() - 1;
-		s->mPartition = &mPartitions[y * KNumPartitions + x];
+		partition.emplace_back(s);
+		gSpheresCollisionInfo.mIndexInPartition[s] = static_cast<int>(partition.size()) - 1;
+		gSpheresCollisionInfo.mPartition[s] = index;
 	}
 
-	auto* GetPartition(CVector2& pos)
+	auto* GetPartition(const CVector& pos)
 	{
-		const auto x = static_cast<int>((pos.x + KRangeSpawn) / kPartitionSize);
-		const auto y = static_cast<int>((pos.y + KRangeSpawn) / kPartitionSize);
-
-		return &mPartitions[y * KNumPartitions + x];
+		return &mPartitions[PartitionIndex(pos)];
 	}
 
+	void RemoveFromPartition(uint32_t s)
+	{
+		auto& spheres = gSpheresCollisionInfo;
+		auto& partition = mPartitions[spheres.mPartition[s]];
+		const auto indexInPartition = spheres.mIndexInPartition[s];
 
-#endif
+		partition[indexInPartition] = partition.back();
+		partition.pop_back();
+
+		if (indexInPartition < static_cast<int>(partition.size()))
+			spheres.mIndexInPartition[partition[indexInPartition]] = indexInPartition;
+		spheres.mIndexInPartition[s] = -1;
+		spheres.mPartition[s] = -1;
+	}
 
-	void RemoveFromPartition(SSphereCollisionInfo* s)
+	// Points the partitions to the new index of the spheres [first, first + order.size()) after the store was
+	// permuted by SSphereStore::Permute, which already moved their mPartition and mIndexInPartition
+	void Renumber(uint32_t first, const std::vector<uint32_t>& order)
 	{
-		s->mPartition->at(s->indexInPartition) = s->mPartition->back();
-		s->mPartition->pop_back();
+		const auto& spheres = gSpheresCollisionInfo;
+		for (auto i = first; i != first + order.size(); ++i)
+		{
+			if (spheres.mPartition[i] != -1) mPartitions[spheres.mPartition[i]][spheres.mIndexInPartition[i]] = i;
+		}
+	}
 
-		if(s->indexInPartition < s->mPartition->size())
-			s->mPartition->at(s->indexInPartition)->indexInPartition = s->indexInPartition;
-		s->indexInPartition = -1;
-		s->mPartition = nullptr;
+	// Removes the spheres removed by SSphereStore::SwapRemoveOrder and points the partitions to the new index of the
+	// others. Called before SSphereStore::Compact, while mPartition and mIndexInPartition are at the old index
+	void Compact(const std::vector<uint32_t>& newIndex)
+	{
+		const auto& spheres = gSpheresCollisionInfo;
+		for (uint32_t s = 0; s < newIndex.size(); ++s)
+		{
+			if (newIndex[s] == SSphereStore::KRemoved && spheres.mPartition[s] != -1) RemoveFromPartition(s);
+		}
+		for (uint32_t s = 0; s < newIndex.size(); ++s)
+		{
+			if (newIndex[s] != SSphereStore::KRemoved && newIndex[s] != s && spheres.mPartition[s] != -1)
+				mPartitions[spheres.mPartition[s]][spheres.mIndexInPartition[s]] = newIndex[s];
+		}
 	}
 };
 
+
+// Returns true and the normal of the wall if the sphere is outside the world bounds
 template<typename T>
-SSphereCollisionInfo* CollisionSpatialPartitioning(SSphereCollisionInfo* sphere, T& surfaceNormal)
+bool CollisionWithWalls(uint32_t sphere, T& surfaceNormal)
 {
+	const auto& spheres = gSpheresCollisionInfo;
+	const auto range = gSettings.mRangeSpawn;
 
-#ifdef _3D
-
-	if (sphere->mPosition.x >= KWallBoundsMax.x ||
-		sphere->mPosition.x <= KWallBoundsMin.x)
+	if (spheres.mPositionX[sphere] >= range ||
+		spheres.mPositionX[sphere] <= -range)
 	{
-		surfaceNormal = CVector3(1.f, 0.f,0.0f);
-		return sphere;
+#ifdef _3D
+		surfaceNormal = CVector3(1.f, 0.f, 0.f);
+#else
+		surfaceNormal = CVector2(1.f, 0.f);
+#endif
+		return true;
 	}
-	if (sphere->mPosition.y >= KWallBoundsMax.y ||
-		sphere->mPosition.y <= KWallBoundsMin.y)
+	if (spheres.mPositionY[sphere] >= range ||
+		spheres.mPositionY[sphere] <= -range)
 	{
-		surfaceNormal = CVector3(0.f, 1.f, 0.0f);
-		return sphere;
+#ifdef _3D
+		surfaceNormal = CVector3(0.f, 1.f, 0.f);
+#else
+		surfaceNormal = CVector2(0.f, 1.f);
+#endif
+		return true;
 	}
-
-	if (sphere->mPosition.z >= KWallBoundsMax.z ||
-		sphere->mPosition.z <= KWallBoundsMin.z)
+#ifdef _3D
+	if (spheres.mPositionZ[sphere] >= range ||
+		spheres.mPositionZ[sphere] <= -range)
 	{
-		surfaceNormal = CVector3(0.f, 0.f, 1.0f);
-		return sphere;
+		surfaceNormal = CVector3(0.f, 0.f, 1.f);
+		return true;
 	}
+#endif
+	return false;
+}
+
+// Distance test between two spheres, with the normal scaled by the squared distance as the original kernels do
+template<typename T>
+inline bool CollisionSphereSphere(uint32_t sphere, uint32_t other, T& surfaceNormal)
+{
+	const auto& spheres = gSpheresCollisionInfo;
 
+	COUNT_PAIR_TEST();
+	const auto vx = spheres.mPositionX[other] - spheres.mPositionX[sphere];
+	const auto vy = spheres.mPositionY[other] - spheres.mPositionY[sphere];
+#ifdef _3D
+	const auto vz = spheres.mPositionZ[other] - spheres.mPositionZ[sphere];
+	const auto mag = vx * vx + vy * vy + vz * vz;
 #else
-	if (sphere->mPosition.x >= KWallBoundsMax.x ||
-		sphere->mPosition.x <= KWallBoundsMin.x)
+	const auto mag = vx * vx + vy * vy;
+#endif
+	const auto rad = spheres.mRadius[other] + spheres.mRadius[sphere];
+
+	if (mag <= rad * rad * (KCollisionRangeScale * KCollisionRangeScale))
 	{
-		surfaceNormal = CVector2(1.f, 0.f);
-		return sphere;
+#ifdef _3D
+		surfaceNormal = T(vx * mag, vy * mag, vz * mag);
+#else
+		surfaceNormal = T(vx * mag, vy * mag);
+#endif
+		return true;
 	}
-	if (sphere->mPosition.y >= KWallBoundsMax.y ||
-		sphere->mPosition.y <= KWallBoundsMin.y)
+	return false;
+}
+
+
+// Tests the sphere against the spheres of a grid cell, calling collided(other, surfaceNormal) for every one hit in the
+// order of the cell until it returns true, returns true if stopped that way
+// The SIMD versions test 16 (AVX-512) or 8 (AVX2) spheres at once and only select the candidates, every candidate
+// is confirmed by CollisionSphereSphere so the hits and the normals are exactly the ones of the scalar loop
+template<typename Collided>
+inline bool ForEachCollisionInCell(uint32_t sphere, const uint32_t* cell, uint32_t count, Collided collided)
+{
+	CVector surfaceNormal;
+	uint32_t i = 0;
+
+#if defined(__AVX512F__)
+
+	const auto& spheres = gSpheresCollisionInfo;
+	const auto x = _mm512_set1_ps(spheres.mPositionX[sphere]);
+	const auto y = _mm512_set1_ps(spheres.mPositionY[sphere]);
+#ifdef _3D
+	const auto z = _mm512_set1_ps(spheres.mPositionZ[sphere]);
+#endif
+	const auto r = _mm512_set1_ps(spheres.mRadius[sphere]);
+	const auto self = _mm512_set1_epi32(static_cast<int>(sphere));
+	const auto scale = _mm512_set1_ps(KCollisionRangeScale * KCollisionRangeScale);
+
+	for (; i < count; i += 16)
 	{
-		surfaceNormal = CVector2(0.f, 1.f);
-		return sphere;
+		// Masked tail: the lanes past the end of the cell are not loaded nor gathered
+		const __mmask16 lanes = count - i >= 16 ? 0xFFFF : static_cast<__mmask16>((1u << (count - i)) - 1);
+		const auto index = _mm512_maskz_loadu_epi32(lanes, cell + i);
+
+		const auto dx = _mm512_sub_ps(_mm512_mask_i32gather_ps(x, lanes, index, spheres.mPositionX.data(), 4), x);
+		const auto dy = _mm512_sub_ps(_mm512_mask_i32gather_ps(y, lanes, index, spheres.mPositionY.data(), 4), y);
+		auto mag = _mm512_add_ps(_mm512_mul_ps(dx, dx), _mm512_mul_ps(dy, dy));
+#ifdef _3D
+		const auto dz = _mm512_sub_ps(_mm512_mask_i32gather_ps(z, lanes, index, spheres.mPositionZ.data(), 4), z);
+		mag = _mm512_add_ps(mag, _mm512_mul_ps(dz, dz));
+#endif
+		const auto rad = _mm512_add_ps(_mm512_mask_i32gather_ps(r, lanes, index, spheres.mRadius.data(), 4), r);
+		const auto limit = _mm512_mul_ps(_mm512_mul_ps(rad, rad), scale);
+
+		COUNT_PAIR_TESTS(std::min(count - i, 16u));
+		auto hits = static_cast<uint32_t>(_mm512_mask_cmp_ps_mask(lanes, mag, limit, _CMP_LE_OQ) & _mm512_cmpneq_epi32_mask(index, self));
+		for (; hits; hits &= hits - 1)
+		{
+			const auto other = cell[i + FirstSetBit(hits)];
+			if (CollisionSphereSphere(sphere, other, surfaceNormal) && collided(other, surfaceNormal)) return true;
+		}
 	}
+
+#elif defined(__AVX2__)
+
+	const auto& spheres = gSpheresCollisionInfo;
+	const auto x = _mm256_set1_ps(spheres.mPositionX[sphere]);
+	const auto y = _mm256_set1_ps(spheres.mPositionY[sphere]);
+#ifdef _3D
+	const auto z = _mm256_set1_ps(spheres.mPositionZ[sphere]);
 #endif
+	const auto r = _mm256_set1_ps(spheres.mRadius[sphere]);
+	const auto self = _mm256_set1_epi32(static_cast<int>(sphere));
+	const auto scale = _mm256_set1_ps(KCollisionRangeScale * KCollisionRangeScale);
+	const auto laneIndex = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
 
-	
-		const std::vector<SSphereCollisionInfo*>* p = gGrid->GetPartition(sphere->mPosition);
+	for (; i < count; i += 8)
+	{
+		// Masked tail: the lanes past the end of the cell are not loaded nor gathered
+		const auto lanes = _mm256_cmpgt_epi32(_mm256_set1_epi32(static_cast<int>(count - i)), laneIndex);
+		const auto index = _mm256_maskload_epi32(reinterpret_cast<const int*>(cell + i), lanes);
+		const auto lanesPs = _mm256_castsi256_ps(lanes);
+
+		const auto dx = _mm256_sub_ps(_mm256_mask_i32gather_ps(x, spheres.mPositionX.data(), index, lanesPs, 4), x);
+		const auto dy = _mm256_sub_ps(_mm256_mask_i32gather_ps(y, spheres.mPositionY.data(), index, lanesPs, 4), y);
+		auto mag = _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy));
+#ifdef _3D
+		const auto dz = _mm256_sub_ps(_mm256_mask_i32gather_ps(z, spheres.mPositionZ.data(), index, lanesPs, 4), z);
+		mag = _mm256_add_ps(mag, _mm256_mul_ps(dz, dz));
+#endif
+		const auto rad = _mm256_add_ps(_mm256_mask_i32gather_ps(r, spheres.mRadius.data(), index, lanesPs, 4), r);
+		const auto limit = _mm256_mul_ps(_mm256_mul_ps(rad, rad), scale);
+
+		const auto candidates = _mm256_andnot_si256(_mm256_cmpeq_epi32(index, self),
+			_mm256_and_si256(lanes, _mm256_castps_si256(_mm256_cmp_ps(mag, limit, _CMP_LE_OQ))));
 
-		for (SSphereCollisionInfo* s : *p)
+		COUNT_PAIR_TESTS(std::min(count - i, 8u));
+		auto hits = static_cast<uint32_t>(_mm256_movemask_ps(_mm256_castsi256_ps(candidates)));
+		for (; hits; hits &= hits - 1)
 		{
-			if (s == sphere) continue;
+			const auto other = cell[i + FirstSetBit(hits)];
+			if (CollisionSphereSphere(sphere, other, surfaceNormal) && collided(other, surfaceNormal)) return true;
+		}
+	}
 
-			const auto v = s->mPosition - sphere->mPosition;
-			const auto mag = v.Magnitude();
-			const auto rad = s->mRadius + sphere->mRadius;
+#else
 
-			if (mag <= rad * rad * 100.f)
-			{
-				surfaceNormal = v * mag;
-				return s;
-			}
+	for (; i < count; ++i)
+	{
+		if (cell[i] == sphere) continue;
 
-		}
+		if (CollisionSphereSphere(sphere, cell[i], surfaceNormal) && collided(cell[i], surfaceNormal)) return true;
+	}
+
+#endif
+
+	return false;
+}
+
+// Returns the first sphere of the cell hit in the order of the cell or KNoCollision
+template<typename T>
+inline int CollisionSphereCell(uint32_t sphere, const uint32_t* cell, uint32_t count, T& surfaceNormal)
+{
+	int hit = KNoCollision;
+	ForEachCollisionInCell(sphere, cell, count, [&](uint32_t other, const CVector& normal)
+	{
+		hit = other;
+		surfaceNormal = normal;
+		return true;
+	});
+	return hit;
+}
+
+
+// Returns the index of the sphere collided with, the sphere itself for a wall or KNoCollision
+template<typename T>
+int CollisionSpatialPartitioning(uint32_t sphere, T& surfaceNormal)
+{
+	if (CollisionWithWalls(sphere, surfaceNormal)) return sphere;
 
-		// if no collision inside the same partition, we need to check also the neighbours partitions
+	const std::vector<uint32_t>* p = gGrid->GetPartition(gSpheresCollisionInfo.Position(sphere));
 
-		std::vector<SSphereCollisionInfo*>* neighbours[8]{nullptr};
-	   //gGrid.GetNeighboursPartitions(sphere->mPosition,neighbours);
+	const auto c = CollisionSphereCell(sphere, p->data(), static_cast<uint32_t>(p->size()), surfaceNormal);
+	if (c != KNoCollision) return c;
 
-	for (int i = 0; i < 8; ++i)
+	// if no collision inside the same partition, we need to check also the neighbours partitions
+
+	std::vector<uint32_t>* neighbours[Grid::KNumNeighbours];
+	gGrid->GetNeighboursPartitions(gSpheresCollisionInfo.Position(sphere), neighbours);
+
+	for (int i = 0; i < Grid::KNumNeighbours; ++i)
 	{
 		auto p = neighbours[i];
 
 		if (p)
 		{
-			for (SSphereCollisionInfo* s : *p)
-			{
-				if (s == sphere) continue;
-
-				const auto v = s->mPosition - sphere->mPosition;
-				const auto mag = v.Magnitude();
-				const auto rad = s->mRadius + sphere->mRadius;
-
-				if (mag <= rad * rad * 100.f)
-				{
-					surfaceNormal = v * mag;
-					return s;
-				}
-			}
+			const auto c = CollisionSphereCell(sphere, p->data(), static_cast<uint32_t>(p->size()), surfaceNormal);
+			if (c != KNoCollision) return c;
 		}
 	}
-	
-	return nullptr;
+
+	return KNoCollision;
 }
 
 
 
 
+// Same as CollisionSpatialPartitioning but using the sorted lists of gSweepAndPrune, which must be up to date
+// Only the spheres whose interval on the x axis overlaps the one of the sphere are tested
+template<typename T>
+inline int CollisionLineSweep(uint32_t sphere, T& surfaceNormal)
+{
+	if (CollisionWithWalls(sphere, surfaceNormal)) return sphere;
+
+	const auto& spheres = gSpheresCollisionInfo;
+	const auto range = spheres.mRadius[sphere] * KCollisionRangeScale;
+	const auto min = spheres.mPositionX[sphere] - range;
+	const auto max = spheres.mPositionX[sphere] + range;
+
+	for (const auto* list : { &gSweepAndPrune->mBlocking, &gSweepAndPrune->mMoving })
+	{
+		for (auto k = list->FirstOverlapping(min); k < list->Size() && list->mMin[k] <= max; ++k)
+		{
+			const auto other = list->mSpheres[k];
+			if (other == sphere || list->mMax[k] < min) continue;
+
+			if (CollisionSphereSphere(sphere, other, surfaceNormal)) return static_cast<int>(other);
+		}
+	}
+
+	return KNoCollision;
+}
+
 template<typename T>
-inline SSphereCollisionInfo* CollisionLineSweep(SSphereCollisionInfo* sphere, T& surfaceNormal)
+inline int Collision(uint32_t sphere, T& surfaceNormal)
 {
+	const auto& spheres = gSpheresCollisionInfo;
+
 	//////////////////////////////
 	///
 	///	Check Edges
@@ -219,210 +449,479 @@ inline SSphereCollisionInfo* CollisionLineSweep(SSphereCollisionInfo* sphere, T&
 	//////////////////////////////
 
 
-	if (sphere->mPosition.x >= KWallBoundsMax.x ||
-		sphere->mPosition.x <= KWallBoundsMin.x)
-	{
-		surfaceNormal = CVector2(1.f, 0.f);
-		sphere->mVelocity = Reflect(sphere->mVelocity, surfaceNormal);
-		return  nullptr;
-	}
+	if (CollisionWithWalls(sphere, surfaceNormal)) return sphere;
+
 
-	if (sphere->mPosition.y >= KWallBoundsMax.y ||
-		sphere->mPosition.y <= KWallBoundsMin.y)
+	//////////////////////////////
+	///
+	/// Collision with blockers
+	///
+	//////////////////////////////
+
+	// The blocking spheres are in no particular order on x (the store is reordered and compacted), all are tested
+	for (uint32_t s = 0; s != spheres.mNumBlocking; ++s)
 	{
-		surfaceNormal = CVector2(0.f, 1.f);
-		sphere->mVelocity = Reflect(sphere->mVelocity, surfaceNormal);
-		return nullptr;
+		if (s == sphere) continue;
+
+		if (CollisionSphereSphere(sphere, s, surfaceNormal)) return s;
 	}
 
 
+
+
 	//////////////////////////////
 	///
-	///	Line Sweep with blockers
+	///	Between moving spheres
 	///
 	//////////////////////////////
 
-	auto blockersStart = gBlockingSpheresCollisionInfo.data();
-	auto blockersEnd = blockersStart + gBlockingSpheresCollisionInfo.size();
+	for (auto sp = spheres.mNumBlocking; sp != spheres.Size(); ++sp)
+	{
+		if (sp == sphere) continue;
 
+		if (CollisionSphereSphere(sphere, sp, surfaceNormal)) return sp;
+	}
 
-	bool found = false;
-	auto s = blockersStart;
-	auto e = blockersEnd;
 
-	auto sr = sphere->mPosition.x + sphere->mRadius;
+	return KNoCollision;
+}
 
-	SSphereCollisionInfo* m;
 
 
-	do
-	{
-		m = s + (int)((e - s) * .5);
-		if (sr <= m->mPosition.x) e = m;
-		else if (sr <= m->mPosition.x) s = m;
-		else						   found = true;
-	} while (!found && e - s > 1);
+// Distance test against the sphere at position k of the sphere copies of grid (gCompactGrid, gHashGrid or gBlockerBVH), same test
+// as CollisionSphereSphere
+template<typename Copies, typename T>
+#ifdef _3D
+inline bool CollisionCompactSphere(const Copies& grid, float x, float y, float z, float r, uint32_t k, T& surfaceNormal)
+#else
+inline bool CollisionCompactSphere(const Copies& grid, float x, float y, float /*z*/, float r, uint32_t k, T& surfaceNormal)
+#endif
+{
 
+	COUNT_PAIR_TEST();
+	const auto vx = grid.mPositionX[k] - x;
+	const auto vy = grid.mPositionY[k] - y;
+#ifdef _3D
+	const auto vz = grid.mPositionZ[k] - z;
+	const auto mag = vx * vx + vy * vy + vz * vz;
+#else
+	const auto mag = vx * vx + vy * vy;
+#endif
+	const auto rad = grid.mRadius[k] + r;
 
-	if (found)
+	if (mag <= rad * rad * (KCollisionRangeScale * KCollisionRangeScale))
 	{
+#ifdef _3D
+		surfaceNormal = T(vx * mag, vy * mag, vz * mag);
+#else
+		surfaceNormal = T(vx * mag, vy * mag);
+#endif
+		return true;
+	}
+	return false;
+}
 
-		auto b = m;
-		while (b != blockersEnd && sr > b->mPosition.x + b->mRadius)
-		{
-			if (b == sphere)
-			{
-				++b; continue;
-			}
+// Tests the sphere against the entries [begin, end) of the sphere copies of grid (gCompactGrid, gHashGrid or gBlockerBVH), calling
+// collided(other, surfaceNormal) for every one hit until it returns true, like ForEachCollisionInCell
+// The entries are contiguous so the SIMD version loads them directly
+template<typename Copies, typename Collided>
+inline bool ForEachCollisionInSpan(const Copies& grid, uint32_t sphere, float x, float y, float z, float r, uint32_t begin, uint32_t end, Collided collided)
+{
+	CVector surfaceNormal;
+	auto k = begin;
+
+#if defined(__AVX2__)
 
+	const auto px = _mm256_set1_ps(x);
+	const auto py = _mm256_set1_ps(y);
+#ifdef _3D
+	const auto pz = _mm256_set1_ps(z);
+#endif
+	const auto pr = _mm256_set1_ps(r);
+	const auto scale = _mm256_set1_ps(KCollisionRangeScale * KCollisionRangeScale);
+	const auto laneIndex = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
 
-			const auto v = b->mPosition - sphere->mPosition;
-			const auto mag = v.Magnitude();
-			const auto rad = b->mRadius + sphere->mRadius;
+	for (; k < end; k += 8)
+	{
+		// Masked tail: the lanes past the end of the span are not loaded
+		const auto lanes = _mm256_cmpgt_epi32(_mm256_set1_epi32(static_cast<int>(end - k)), laneIndex);
 
-			if (mag <= rad * rad * 100.f)
-			{
-				surfaceNormal = CVector2(v.x * mag, v.y * mag);
-				return b;
-			}++b;
-		}
+		const auto dx = _mm256_sub_ps(_mm256_maskload_ps(grid.mPositionX.data() + k, lanes), px);
+		const auto dy = _mm256_sub_ps(_mm256_maskload_ps(grid.mPositionY.data() + k, lanes), py);
+		auto mag = _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy));
+#ifdef _3D
+		const auto dz = _mm256_sub_ps(_mm256_maskload_ps(grid.mPositionZ.data() + k, lanes), pz);
+		mag = _mm256_add_ps(mag, _mm256_mul_ps(dz, dz));
+#endif
+		const auto rad = _mm256_add_ps(_mm256_maskload_ps(grid.mRadius.data() + k, lanes), pr);
+		const auto limit = _mm256_mul_ps(_mm256_mul_ps(rad, rad), scale);
 
-		b = m;
-		while (b-- != blockersStart && sr < b->mPosition.x - b->mRadius)
+		COUNT_PAIR_TESTS(std::min(end - k, 8u));
+		auto hits = static_cast<uint32_t>(_mm256_movemask_ps(_mm256_and_ps(_mm256_castsi256_ps(lanes), _mm256_cmp_ps(mag, limit, _CMP_LE_OQ))));
+		for (; hits; hits &= hits - 1)
 		{
-			if (b == sphere)
-			{
-				continue;
-			}
+			const auto c = k + FirstSetBit(hits);
+			if (grid.mSpheres[c] != sphere && CollisionCompactSphere(grid, x, y, z, r, c, surfaceNormal) && collided(grid.mSpheres[c], surfaceNormal)) return true;
+		}
+	}
 
-			const auto v = b->mPosition - sphere->mPosition;
-			const auto mag = v.Magnitude();
-			const auto rad = b->mRadius + sphere->mRadius;
+#else
 
-			if (mag <= rad * rad * 100)
-			{
-				surfaceNormal = CVector2(v.x * mag, v.y * mag);
-				return b;
-			}
+	for (; k < end; ++k)
+	{
+		if (grid.mSpheres[k] == sphere) continue;
 
-		}
+		if (CollisionCompactSphere(grid, x, y, z, r, k, surfaceNormal) && collided(grid.mSpheres[k], surfaceNormal)) return true;
 	}
 
+#endif
 
-	//////////////////////////////
-	///
-	///	TODO: Between moving spheres
-	///
-	//////////////////////////////
+	return false;
+}
+
+// Same as CollisionSpatialPartitioning but using gCompactGrid, built at the start of the frame
+// The sphere is tested against its partition and all the neighbouring ones, scanning each row of neighbours as one span
+template<typename T>
+int CollisionCompactGrid(uint32_t sphere, T& surfaceNormal)
+{
+	if (CollisionWithWalls(sphere, surfaceNormal)) return sphere;
 
-	auto sp = gMovingSpheresCollisionInfo.data();
-	auto spEnd = sp + gMovingSpheresCollisionInfo.size();
+	const auto& spheres = gSpheresCollisionInfo;
+	const auto& grid = *gCompactGrid;
 
-	while (sp != spEnd)
-	{
-		if (sp == sphere) { ++sp; continue; }
+	const auto x = spheres.mPositionX[sphere];
+	const auto y = spheres.mPositionY[sphere];
+#ifdef _3D
+	const auto z = spheres.mPositionZ[sphere];
+	const auto cz = grid.PartitionCoordinate(z);
+	const auto z0 = std::max(cz - 1, 0), z1 = std::min(cz + 1, grid.mNumPartitions - 1);
+#else
+	const auto z = 0.f;
+	const auto z0 = 0, z1 = 0;
+#endif
+	const auto r = spheres.mRadius[sphere];
 
-		const auto v = sp->mPosition - sphere->mPosition;
-		const auto mag = v.Magnitude();
-		const auto rad = sp->mRadius + sphere->mRadius;
+	const auto cx = grid.PartitionCoordinate(x);
+	const auto cy = grid.PartitionCoordinate(y);
+	const auto x0 = std::max(cx - 1, 0), x1 = std::min(cx + 1, grid.mNumPartitions - 1);
+	const auto y0 = std::max(cy - 1, 0), y1 = std::min(cy + 1, grid.mNumPartitions - 1);
 
-		if (mag <= rad * rad * 100)
+	for (auto pz = z0; pz <= z1; ++pz)
+	{
+		for (auto py = y0; py <= y1; ++py)
 		{
-			surfaceNormal = CVector2(v.x * mag, v.y * mag);
-			return sp;
+			const auto begin = grid.mPartitionStart[grid.PartitionIndex(x0, py, pz)];
+			const auto end = grid.mPartitionStart[grid.PartitionIndex(x1, py, pz) + 1];
+
+			int hit = KNoCollision;
+			ForEachCollisionInSpan(grid, sphere, x, y, z, r, begin, end, [&](uint32_t other, const CVector& normal)
+			{
+				hit = other;
+				surfaceNormal = normal;
+				return true;
+			});
+			if (hit != KNoCollision) return hit;
 		}
-		++sp;
 	}
 
-
-	return nullptr;
+	return KNoCollision;
 }
 
-template<typename T>
-inline SSphereCollisionInfo* Collision(SSphereCollisionInfo* sphere, T& surfaceNormal)
+
+
+#include "AABBTree.h"
+#include "LooseTree.h"
+#include "BlockerBVH.h"
+#include "Reorder.h"
+
+
+//---------------------------------------------------------------------------------------------------------------------
+// Pair enumeration
+//---------------------------------------------------------------------------------------------------------------------
+
+// Offsets of the partitions forming the half stencil of a partition: the one on its right and the three of the next row
+// (in 3D also the nine of the next plane). A partition is scanned against itself and its half stencil only, so every
+// pair of neighbouring partitions is visited once and every pair of spheres is tested once per frame
+#ifdef _3D
+constexpr int KHalfStencilSize = 13;
+#else
+constexpr int KHalfStencilSize = 4;
+#endif
+constexpr int KHalfStencil[KHalfStencilSize][3] =
 {
-	//////////////////////////////
-	///
-	///	Check Edges
-	///
-	//////////////////////////////
+	{ 1, 0, 0 }, { -1, 1, 0 }, { 0, 1, 0 }, { 1, 1, 0 },
+#ifdef _3D
+	{ -1, -1, 1 }, { 0, -1, 1 }, { 1, -1, 1 },
+	{ -1,  0, 1 }, { 0,  0, 1 }, { 1,  0, 1 },
+	{ -1,  1, 1 }, { 0,  1, 1 }, { 1,  1, 1 },
+#endif
+};
 
+// Records a contact found by the pair enumeration, the pairs of blocking spheres are dropped as neither of them moves
+// Returns false so the scan goes on with the next sphere
+inline bool AddContact(std::vector<SContact>& contacts, uint32_t sphere, uint32_t other, const CVector& surfaceNormal)
+{
+	if (!gSpheresCollisionInfo.IsBlocking(sphere) || !gSpheresCollisionInfo.IsBlocking(other))
+		contacts.push_back({ { sphere, other }, surfaceNormal });
+	return false;
+}
 
-	if (sphere->mPosition.x >= KWallBoundsMax.x ||
-		sphere->mPosition.x <= KWallBoundsMin.x)
-	{
-		surfaceNormal = CVector2(1.f, 0.f);
-		return  sphere;
-	}
+// Finds the contacts between the spheres of the partitions [first, last) of gGrid, and between them and the spheres
+// of their half stencil
+inline void FindContactsGrid(uint32_t first, uint32_t last, std::vector<SContact>& contacts)
+{
+	const auto& grid = *gGrid;
+	const auto n = grid.mNumPartitions;
 
-	if (sphere->mPosition.y >= KWallBoundsMax.y ||
-		sphere->mPosition.y <= KWallBoundsMin.y)
+	for (auto p = first; p != last; ++p)
 	{
-		surfaceNormal = CVector2(0.f, 1.f);
-		return sphere;
-	}
+		const auto& partition = grid.mPartitions[p];
+		const auto count = static_cast<uint32_t>(partition.size());
+		if (count == 0) continue;
 
+		const auto x = static_cast<int>(p) % n;
+		const auto y = static_cast<int>(p) / n % n;
+		const auto z = static_cast<int>(p) / (n * n);
 
-	//////////////////////////////
-	///
-	/// Collision with blockers
-	///
-	//////////////////////////////
+		const std::vector<uint32_t>* neighbours[KHalfStencilSize];
+		auto numNeighbours = 0;
+		for (const auto& offset : KHalfStencil)
+		{
+			const auto nx = x + offset[0], ny = y + offset[1], nz = z + offset[2];
+#ifdef _3D
+			const bool inside = nx >= 0 && nx < n && ny >= 0 && ny < n && nz < n;
+#else
+			const bool inside = nx >= 0 && nx < n && ny < n;
+#endif
+			if (inside && !grid.mPartitions[grid.to1D(nx, ny, nz)].empty()) neighbours[numNeighbours++] = &grid.mPartitions[grid.to1D(nx, ny, nz)];
+		}
 
-	auto s = gBlockingSpheresCollisionInfo.data();
-	auto blockersEnd = s + gBlockingSpheresCollisionInfo.size();
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			const auto sphere = partition[i];
+			const auto collided = [&](uint32_t other, const CVector& surfaceNormal) { return AddContact(contacts, sphere, other, surfaceNormal); };
 
-	auto sr = sphere->mPosition.x + sphere->mRadius;
+			// Inside the partition only the spheres after this one, the ones before already tested against it
+			ForEachCollisionInCell(sphere, partition.data() + i + 1, count - i - 1, collided);
 
-	while (s != blockersEnd && sr > s->mPosition.x + s->mRadius)
+			for (auto j = 0; j < numNeighbours; ++j)
+				ForEachCollisionInCell(sphere, neighbours[j]->data(), static_cast<uint32_t>(neighbours[j]->size()), collided);
+		}
+	}
+}
+
+// Same as FindContactsGrid using gCompactGrid, built at the start of the frame
+// The half stencil is scanned as contiguous spans: the rest of the partition together with the partition on its right,
+// then each row of three partitions below it
+inline void FindContactsCompactGrid(uint32_t first, uint32_t last, std::vector<SContact>& contacts)
+{
+	const auto& grid = *gCompactGrid;
+	const auto n = grid.mNumPartitions;
+
+	for (auto p = first; p != last; ++p)
 	{
-		if (s == sphere)
+		const auto begin = grid.mPartitionStart[p];
+		const auto end = grid.mPartitionStart[p + 1];
+		if (begin == end) continue;
+
+		const auto x = static_cast<int>(p) % n;
+		const auto y = static_cast<int>(p) / n % n;
+		const auto z = static_cast<int>(p) / (n * n);
+		const auto x0 = std::max(x - 1, 0), x1 = std::min(x + 1, n - 1);
+
+		// Rows of the half stencil after the one of the partition
+		uint32_t rowBegin[4], rowEnd[4];
+		auto numRows = 0;
+		const auto addRow = [&](int ry, int rz)
+		{
+			if (ry < 0 || ry >= n || rz >= n) return;
+			rowBegin[numRows] = grid.mPartitionStart[grid.PartitionIndex(x0, ry, rz)];
+			rowEnd[numRows] = grid.mPartitionStart[grid.PartitionIndex(x1, ry, rz) + 1];
+			if (rowBegin[numRows] != rowEnd[numRows]) ++numRows;
+		};
+		addRow(y + 1, z);
+#ifdef _3D
+		for (auto ry = y - 1; ry <= y + 1; ++ry) addRow(ry, z + 1);
+#endif
+		const auto rowOfPartitionEnd = grid.mPartitionStart[grid.PartitionIndex(x1, y, z) + 1];
+
+		for (auto k = begin; k != end; ++k)
 		{
-			++s; continue;
+			const auto sphere = grid.mSpheres[k];
+			const auto sx = grid.mPositionX[k];
+			const auto sy = grid.mPositionY[k];
+#ifdef _3D
+			const auto sz = grid.mPositionZ[k];
+#else
+			const auto sz = 0.f;
+#endif
+			const auto sr = grid.mRadius[k];
+			const auto collided = [&](uint32_t other, const CVector& surfaceNormal) { return AddContact(contacts, sphere, other, surfaceNormal); };
+
+			ForEachCollisionInSpan(grid, sphere, sx, sy, sz, sr, k + 1, rowOfPartitionEnd, collided);
+
+			for (auto row = 0; row < numRows; ++row)
+				ForEachCollisionInSpan(grid, sphere, sx, sy, sz, sr, rowBegin[row], rowEnd[row], collided);
 		}
+	}
+}
 
+// Same as FindContactsCompactGrid using gHashGrid, over its cells [first, last)
+// The cells of the half stencil are found in the hash table, those with no sphere are not in it and are skipped
+inline void FindContactsHashGrid(uint32_t first, uint32_t last, std::vector<SContact>& contacts)
+{
+	const auto& grid = *gHashGrid;
 
-		const auto v = s->mPosition - sphere->mPosition;
-		const auto mag = v.Magnitude();
-		const auto rad = s->mRadius + sphere->mRadius;
+	for (auto c = first; c != last; ++c)
+	{
+		const auto begin = grid.mCellStart[c];
+		const auto end = grid.mCellStart[c + 1];
+		const auto& key = grid.mCellKeys[c];
 
-		if (mag <= rad * rad * 100.f)
+		uint32_t neighbourBegin[KHalfStencilSize], neighbourEnd[KHalfStencilSize];
+		auto numNeighbours = 0;
+		for (const auto& offset : KHalfStencil)
 		{
-			surfaceNormal = CVector2(v.x * mag, v.y * mag);
-			return s;
+			const auto neighbour = grid.Find({ key.x + offset[0], key.y + offset[1], key.z + offset[2] });
+			if (neighbour == HashGrid::KEmpty) continue;
+			neighbourBegin[numNeighbours] = grid.mCellStart[neighbour];
+			neighbourEnd[numNeighbours] = grid.mCellStart[neighbour + 1];
+			++numNeighbours;
 		}
 
-		++s;
+		for (auto k = begin; k != end; ++k)
+		{
+			const auto sphere = grid.mSpheres[k];
+			const auto sx = grid.mPositionX[k];
+			const auto sy = grid.mPositionY[k];
+#ifdef _3D
+			const auto sz = grid.mPositionZ[k];
+#else
+			const auto sz = 0.f;
+#endif
+			const auto sr = grid.mRadius[k];
+			const auto collided = [&](uint32_t other, const CVector& surfaceNormal) { return AddContact(contacts, sphere, other, surfaceNormal); };
+
+			ForEachCollisionInSpan(grid, sphere, sx, sy, sz, sr, k + 1, end, collided);
+
+			for (auto j = 0; j < numNeighbours; ++j)
+				ForEachCollisionInSpan(grid, sphere, sx, sy, sz, sr, neighbourBegin[j], neighbourEnd[j], collided);
+		}
 	}
+}
 
+// Finds the contacts of the moving spheres [first, last) of the sorted moving list of gSweepAndPrune
+// Each is swept against the moving spheres after it in the list, so every pair of moving spheres is tested once,
+// and against the blocking spheres whose interval overlaps its own
+inline void FindContactsSweepAndPrune(uint32_t first, uint32_t last, std::vector<SContact>& contacts)
+{
+	const auto& moving = gSweepAndPrune->mMoving;
+	const auto& blocking = gSweepAndPrune->mBlocking;
+	CVector surfaceNormal;
 
+	for (auto k = first; k != last; ++k)
+	{
+		const auto sphere = moving.mSpheres[k];
+		const auto min = moving.mMin[k];
+		const auto max = moving.mMax[k];
 
+		for (auto j = k + 1; j < moving.Size() && moving.mMin[j] <= max; ++j)
+		{
+			if (CollisionSphereSphere(sphere, moving.mSpheres[j], surfaceNormal)) AddContact(contacts, sphere, moving.mSpheres[j], surfaceNormal);
+		}
 
-	//////////////////////////////
-	///
-	///	TODO: Between moving spheres
-	///
-	//////////////////////////////
+		for (auto j = blocking.FirstOverlapping(min); j < blocking.Size() && blocking.mMin[j] <= max; ++j)
+		{
+			if (blocking.mMax[j] >= min && CollisionSphereSphere(sphere, blocking.mSpheres[j], surfaceNormal))
+				AddContact(contacts, sphere, blocking.mSpheres[j], surfaceNormal);
+		}
+	}
+}
 
-	auto sp = gMovingSpheresCollisionInfo.data();
-	auto spEnd = sp + gMovingSpheresCollisionInfo.size();
+// Finds the contacts between the moving spheres [first, last) of the store and the blocking spheres of gBlockerBVH
+inline void FindContactsBlockerBVH(uint32_t first, uint32_t last, std::vector<SContact>& contacts)
+{
+	for (auto sphere = first; sphere != last; ++sphere)
+	{
+		gBlockerBVH->Query(sphere, [&](uint32_t other, const CVector& surfaceNormal) { return AddContact(contacts, sphere, other, surfaceNormal); });
+	}
+}
+
+// Finds the contacts of the moving spheres [first, last) of the query order of gAABBTree
+// Two spheres that collide find each other's leaf, as the fat box of a sphere contains the box of its collision range,
+// so a pair of moving spheres is only kept from the one with the higher index
+inline void FindContactsAABBTree(uint32_t first, uint32_t last, std::vector<SContact>& contacts)
+{
+	const auto& spheres = gSpheresCollisionInfo;
+	CVector surfaceNormal;
 
-	while (sp != spEnd)
+	for (auto k = first; k != last; ++k)
 	{
-		if (sp == sphere) { ++sp; continue; }
+		const auto sphere = gAABBTree->mQueryOrder[k];
+		gAABBTree->Query(SAABB::OfSphere(sphere), [&](uint32_t other)
+		{
+			if (other >= sphere && !spheres.IsBlocking(other)) return;
 
-		const auto v = sp->mPosition - sphere->mPosition;
-		const auto mag = v.Magnitude();
-		const auto rad = sp->mRadius + sphere->mRadius;
+			if (CollisionSphereSphere(sphere, other, surfaceNormal)) AddContact(contacts, sphere, other, surfaceNormal);
+		});
+	}
+}
+
+// Finds the contacts of the moving spheres stored in the nodes [first, last) of gLooseTree
+// A sphere is tested against the spheres of all the nodes whose loose box overlaps its collision range, two spheres
+// that collide find each other so a pair of moving spheres is only kept from the one with the higher index
+inline void FindContactsLooseTree(uint32_t first, uint32_t last, std::vector<SContact>& contacts)
+{
+	const auto& spheres = gSpheresCollisionInfo;
+	const auto& tree = *gLooseTree;
 
-		if (mag <= rad * rad * 100)
+	for (auto n = first; n != last; ++n)
+	{
+		for (const auto sphere : tree.mNodes[n].mSpheres)
 		{
-			surfaceNormal = CVector2(v.x * mag, v.y * mag);
-			return sp;
+			if (spheres.IsBlocking(sphere)) continue;
+
+			tree.Query(SAABB::OfSphere(sphere), [&](const LooseTree::SNode& node)
+			{
+				ForEachCollisionInCell(sphere, node.mSpheres.data(), static_cast<uint32_t>(node.mSpheres.size()), [&](uint32_t other, const CVector& surfaceNormal)
+				{
+					if (other > sphere && !spheres.IsBlocking(other)) return false;
+					return AddContact(contacts, sphere, other, surfaceNormal);
+				});
+			});
 		}
-		++sp;
 	}
+}
 
+// Finds the contacts of the partitions [first, last) of the broadphase in use
+inline void FindContacts(uint32_t first, uint32_t last, std::vector<SContact>& contacts)
+{
+	switch (gSettings.mBroadphase)
+	{
+	case EBroadphase::Grid:          FindContactsGrid(first, last, contacts); break;
+	case EBroadphase::CompactGrid:   FindContactsCompactGrid(first, last, contacts); break;
+	case EBroadphase::HashGrid:      FindContactsHashGrid(first, last, contacts); break;
+	case EBroadphase::SweepAndPrune: FindContactsSweepAndPrune(first, last, contacts); break;
+	case EBroadphase::AABBTree:      FindContactsAABBTree(first, last, contacts); break;
+	case EBroadphase::LooseTree:     FindContactsLooseTree(first, last, contacts); break;
+	}
+}
 
-	return nullptr;
+// Number of partitions of the broadphase in use, the range FindContacts is called on
+// The sweep and prune and the tree have no partitions, their range is the list of moving spheres
+inline uint32_t NumBroadphasePartitions()
+{
+	switch (gSettings.mBroadphase)
+	{
+	case EBroadphase::Grid:          return static_cast<uint32_t>(gGrid->mPartitions.size());
+	case EBroadphase::CompactGrid:   return static_cast<uint32_t>(gCompactGrid->mPartitionStart.size() - 1);
+	case EBroadphase::HashGrid:      return gHashGrid->NumCells();
+	case EBroadphase::SweepAndPrune: return gSweepAndPrune->mMoving.Size();
+	case EBroadphase::AABBTree:      return static_cast<uint32_t>(gAABBTree->mQueryOrder.size());
+	case EBroadphase::LooseTree:     return static_cast<uint32_t>(gLooseTree->mNodes.size());
+	}
+	return 0;
 }
+
+
+#include "Continuous.h"
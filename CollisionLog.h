@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+#include <ctime>
+#include <vector>
+
+// Collision events of the frame, kept until they are handed to the log writer
+// An event is a fixed size record (no strings, the names are looked up when rendering). The events are recorded while
+// the contacts are resolved, on one thread in the order of the sorted contacts, into one buffer reserved upfront, so
+// recording an event does not allocate once the buffer is warm
+struct SCollisionEvent
+{
+	uint32_t mId[2];				// Id of the spheres, see SSphere
+	uint8_t  mHealthRemaining[2];
+	int64_t  mTime;
+};
+
+class CollisionLog
+{
+
+public:
+
+	// Events reserved in the buffer, it only grows when more are recorded in one frame
+	static constexpr uint32_t KReservedEvents = 4096;
+
+	CollisionLog()
+	{
+		mEvents.reserve(KReservedEvents);
+	}
+
+	void Record(uint32_t first, uint32_t second, uint8_t healthFirst, uint8_t healthSecond, int64_t time)
+	{
+		mEvents.push_back({ { first, second }, { healthFirst, healthSecond }, time });
+	}
+
+	// Calls visit(event) for the events in the order they were recorded
+	template<typename Visit>
+	void ForEach(Visit visit) const
+	{
+		for (const auto& event : mEvents) visit(event);
+	}
+
+	size_t Size() const { return mEvents.size(); }
+
+	// Keeps the memory of the buffer
+	void Clear()
+	{
+		mEvents.clear();
+	}
+
+private:
+
+	std::vector<SCollisionEvent> mEvents;
+};
@@ -1,17 +1,30 @@
 #pragma once
 
 #ifdef _WIN32
+// Windows.h defines min and max as macros, which break the calls to std::min and std::max
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
 #include <Windows.h>
 #else
 #include <unistd.h>
 #endif
 
 class Grid;
+class CompactGrid;
+class HashGrid;
+class SweepAndPrune;
+class BlockerBVH;
+class AABBTree;
+class LooseTree;
+class TaskScheduler;
 using namespace std;
 
+#include <chrono>
 #include <condition_variable>
+#include <ctime>
+#include <mutex>
 #include <thread>
-#include <concurrent_vector.h>
 #include <vector>
 
 #include "Math/CVector2.h"
@@ -27,8 +40,10 @@ using namespace std;
 // Settings
 //---------------------------------------------------------------
 
-
+// _HEADLESS is defined by the CMake build so the simulation runs without the TL-Engine
+#ifndef _HEADLESS
 #define _VISUALIZATION_ON
+#endif
 //#define _LOG
 //#define _3D
 
@@ -46,9 +61,13 @@ using namespace tle;
 
 I3DEngine* myEngine;
 ICamera* myCamera;
+IMesh* mySphereMesh;
+IMesh* myBlockedMesh;
 
 #endif
 
+#include "SphereHandles.h"
+
 struct SSphere
 {
 
@@ -58,98 +77,134 @@ struct SSphere
 
 	CVector3 mColour;
 	uint8_t  mHealth = 100;
-	std::string  mName;
+	uint32_t mId = 0;		// Order the sphere was spawned in, kept when the store is reordered. Its name in the log is gSphereNames[mId]
+	SSphereHandle mHandle;	// Handle of the sphere in gSphereHandles
 };
 
-struct SSphereCollisionInfo
-{
 #ifdef _3D
-	CVector3 mVelocity;
-	CVector3 mPosition;
+using CVector = CVector3;
 #else
-	CVector2 mVelocity;
-	CVector2 mPosition;
+using CVector = CVector2;
 #endif
-	float mRadius;
 
-	// Spatial partitioning helper code
+#include "SphereStore.h"
 
-	int indexInPartition = -1;
-	int index; // to keep track of its position in the array , negative for the blocking spheres, positive for the moving spheres
-	std::vector<SSphereCollisionInfo*>* mPartition = nullptr; // to keep track of the partition this sphere is in
-};
+// Returned by the collision functions when the sphere does not collide with anything
+constexpr int KNoCollision = -1;
 
 
 //---------------------------------------------------------------------------------------------------------------------
 // Thread Pools
 //---------------------------------------------------------------------------------------------------------------------
 
-// A worker thread wakes up when work is signalled to be ready, and signals back when the work is complete.
-// Same condition variable is used for signalling in both directions.
-// A mutex is used to guard data shared between threads
-struct WorkerThread
-{
-	std::thread             thread;
-	std::condition_variable workReady;
-	std::mutex              lock;
-};
+// Task run by ParallelFor on a chunk [start, end) of its range, thread is 0 for the main thread and i + 1 for the worker i
+// A thread can run several chunks of the same range, see TaskScheduler.h
+using WorkTask = void (*)(uint32_t thread, uint32_t start, uint32_t end);
 
-// Data describing work to do by a worker thread - this task is collision detection between some sprites against some blockers
-struct UpdateSpheresWork
+// Largest number of worker threads of the pool, the main thread also runs tasks
+static const uint32_t MAX_WORKERS = 31;
+
+// Pool running the tasks of the frame
+TaskScheduler* gTaskScheduler;
+
+
+#include "CollisionLog.h"
+#include "LogWriter.h"
+
+CollisionLog gCollisionLog;
+
+// Writes the collisions of every frame to disk on its own thread, only created in _LOG builds
+LogWriter* gLogWriter = nullptr;
+
+// Two spheres found colliding by the broad phase, every pair is found once per frame
+struct SContact
 {
-	bool     complete = true;
-	SSphereCollisionInfo* start; // The work is described simply as the parameters to the BlockSprites function
-	SSphereCollisionInfo* end;
-};
+	uint32_t mSphere[2];
+	CVector  mNormal;		// From the first sphere to the second, not normalised
 
+	bool operator<(const SContact& c) const { return mSphere[0] < c.mSphere[0] || (mSphere[0] == c.mSphere[0] && mSphere[1] < c.mSphere[1]); }
+};
 
+// Contacts found during the frame, one buffer per thread so they are filled without locking
+std::vector<SContact> gContacts[MAX_WORKERS + 1];
 
-// A pool of worker threads, each with its associated work
-// A more flexible system could generalise the type of work that worker threads can do
-static const uint32_t                      MAX_WORKERS = 31;
-std::pair<WorkerThread, UpdateSpheresWork> mUpdateSpheresWorkers[MAX_WORKERS];
-uint32_t                                   mNumWorkers; // Actual number of worker threads being used in array above
+// Contacts of all the threads with the lowest index first, sorted so they are resolved in the same order whichever
+// thread found them
+std::vector<SContact> gSortedContacts;
 
+// Spheres that left their place in the broadphase while moved, one list per thread, moved once all the threads finished
+std::vector<uint32_t> gMigrations[MAX_WORKERS + 1];
 
-struct CollisionInfoData
+// A sphere moving between partitions of the grid, with the partition it is removed from or added to
+struct SMigration
 {
-	int time;
-	std::string name[2];
-	uint8_t healthRemaining[2];
+	uint32_t mPartition;
+	uint32_t mSphere;
+
+	bool operator<(const SMigration& m) const { return mPartition < m.mPartition || (mPartition == m.mPartition && mSphere < m.mSphere); }
 };
 
-std::vector<CollisionInfoData> gCollisionInfoData;
+// Migrations of all the threads sorted by partition, so each thread of the merge owns the partitions of its range
+std::vector<SMigration> gGridMigrations;
 
 bool bUsingMultithreading = false;
 
-constexpr uint32_t KNumOfSpheresSQRD = 100;
-constexpr uint32_t KNumOfSpheres = KNumOfSpheresSQRD * KNumOfSpheresSQRD;
-constexpr float KRangeSpawn = 5000.f;
-constexpr uint32_t KNumPartitions = 20;
-constexpr int kPartitionSize = (int)KRangeSpawn / KNumPartitions * 2;
-constexpr float KRangeVelocity = 50.f;
-constexpr float KRangeRadius = 2.f;
+// Largest distance a moving sphere travels on one axis during the frame, only computed in continuous mode
+float gSweptMargin = 0.f;
 
-#ifdef _3D
-CVector3 KWallBoundsMax = CVector3(KRangeSpawn, KRangeSpawn,KRangeSpawn);
-CVector3 KWallBoundsMin = -KWallBoundsMax;
-#else
-CVector2 KWallBoundsMax = CVector2(KRangeSpawn, KRangeSpawn);
-CVector2 KWallBoundsMin = -KWallBoundsMax;
-#endif
+// Spheres collide when closer than this many times the sum of their radii
+constexpr float KCollisionRangeScale = 10.f;
+
+// Health lost by both spheres of a collision, a sphere is removed once its health reaches 0 (see RemoveDeadSpheres)
+constexpr uint8_t KCollisionDamage = 20;
+
+// Fraction of the speed along the normal kept by two spheres bouncing off each other, 1 is a perfectly elastic bounce
+constexpr float KRestitution = 1.f;
+
+// World size, sphere count and grid resolution are set at run time, see Settings.h
+#include "Settings.h"
+
+SSettings gSettings;
 
 // DOD approach
-// Keep only the collision related information in a separate vector
+// Keep only the collision related information in a separate store, gSpheres[i] holds the rest of the data of sphere i
 
-SSphere gMovingSpheres[KNumOfSpheres /2];
-SSphere gBlockingSpheres[KNumOfSpheres/2];
+std::vector<SSphere> gSpheres;
 
-vector<SSphereCollisionInfo> gMovingSpheresCollisionInfo;
-vector<SSphereCollisionInfo> gBlockingSpheresCollisionInfo;
+#ifdef _LOG
+// Name of every sphere indexed by its id, only filled in _LOG builds where the log writer copies them to every file
+std::vector<std::string> gSphereNames;
+#endif
+
+SSphereStore gSpheresCollisionInfo;
+
+// Index in the store of the sphere of every handle, the index of a sphere changes when the store is reordered or
+// compacted, its handle does not
+SphereHandles gSphereHandles;
+
+// Spheres whose health reached 0 during the frame, removed at the end of the frame
+std::vector<uint32_t> gDeadSpheres;
 
-Grid* gGrid;
+#ifdef _VISUALIZATION_ON
+// Double buffered snapshot of the positions after the last two physics steps, indexed by the slot of the handle of the
+// sphere so it follows the sphere when the store is reordered or compacted. A step writes the back buffer, which then
+// becomes the front one. The models are placed from the two buffers only, drawing never reads the store
+std::vector<CVector> gRenderPositions[2];
+uint32_t gRenderFront = 0;
+#endif
+
+// Only the broadphase in use is created, the others stay null
+Grid* gGrid = nullptr;
+CompactGrid* gCompactGrid = nullptr;
+HashGrid* gHashGrid = nullptr;
+SweepAndPrune* gSweepAndPrune = nullptr;
+BlockerBVH* gBlockerBVH = nullptr;
+AABBTree* gAABBTree = nullptr;
+LooseTree* gLooseTree = nullptr;
 
 float frameTime;
 float renderingTime;
 float workTime;
-float totalTime = -1;
+
+// Seconds simulated by every call to UpdateSpheres, the fixed step gSettings.mTimeStep whatever the time taken to render
+float totalTime = 1.f / 60.f;
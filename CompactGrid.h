@@ -0,0 +1,111 @@
+#pragma once
+
+#include "Common.h"
+
+// Grid rebuilt from scratch every frame with a counting sort, as an alternative to the incremental Grid
+// The partitions are stored CSR style: the spheres of partition p are mSpheres[mPartitionStart[p], mPartitionStart[p + 1])
+// and their positions and radii are copied in the same order, so a partition and its neighbours on the x axis
+// are contiguous in memory and can be scanned without following any index
+class CompactGrid
+{
+
+public:
+
+	CompactGrid() :
+		mNumPartitions(static_cast<int>(gSettings.mNumPartitions)),
+		mPartitionSize(gSettings.mPartitionSize),
+		mRangeSpawn(gSettings.mRangeSpawn)
+	{
+#ifdef _3D
+		mPartitionStart.resize(static_cast<size_t>(mNumPartitions) * mNumPartitions * mNumPartitions + 1);
+#else
+		mPartitionStart.resize(static_cast<size_t>(mNumPartitions) * mNumPartitions + 1);
+#endif
+	}
+
+	int mNumPartitions;
+	float mPartitionSize;
+	float mRangeSpawn;
+
+	std::vector<uint32_t> mPartitionStart;	// One more than the number of partitions, the last is the number of spheres
+
+	// Sorted by partition
+	std::vector<uint32_t> mSpheres;			// Index of the sphere in gSpheresCollisionInfo
+	std::vector<float> mPositionX;
+	std::vector<float> mPositionY;
+#ifdef _3D
+	std::vector<float> mPositionZ;
+#endif
+	std::vector<float> mRadius;
+
+	std::vector<uint32_t> mSpherePartition;	// Partition of every sphere sorted, only used while building
+
+
+	// Coordinate of the partition along one axis, positions outside the world are clamped to the edge partitions
+	int PartitionCoordinate(float p) const
+	{
+		auto c = static_cast<int>((p + mRangeSpawn) / mPartitionSize);
+		if (c >= mNumPartitions) c = mNumPartitions - 1;
+		if (c < 0) c = 0;
+		return c;
+	}
+
+	int PartitionIndex(int x, int y, int z) const
+	{
+		return (z * mNumPartitions + y) * mNumPartitions + x;
+	}
+
+	// Counting sort of all the spheres of the store by partition, only the moving ones when the blocking ones are in the BVH
+	void Build()
+	{
+		const auto& spheres = gSpheresCollisionInfo;
+		const auto firstSphere = gSettings.mBlockerBVH ? spheres.mNumBlocking : 0u;
+		const auto numSpheres = spheres.Size() - firstSphere;
+		const auto numPartitions = static_cast<uint32_t>(mPartitionStart.size() - 1);
+
+		mSpherePartition.resize(numSpheres);
+		mSpheres.resize(numSpheres);
+		mPositionX.resize(numSpheres);
+		mPositionY.resize(numSpheres);
+#ifdef _3D
+		mPositionZ.resize(numSpheres);
+#endif
+		mRadius.resize(numSpheres);
+
+		// Count the spheres of every partition
+		std::fill(mPartitionStart.begin(), mPartitionStart.end(), 0u);
+		for (uint32_t k = 0; k < numSpheres; ++k)
+		{
+			const auto i = firstSphere + k;
+#ifdef _3D
+			const auto z = PartitionCoordinate(spheres.mPositionZ[i]);
+#else
+			const auto z = 0;
+#endif
+			const auto p = PartitionIndex(PartitionCoordinate(spheres.mPositionX[i]), PartitionCoordinate(spheres.mPositionY[i]), z);
+			mSpherePartition[k] = p;
+			++mPartitionStart[p + 1];
+		}
+
+		// Prefix sum, mPartitionStart[p + 1] becomes the end of partition p
+		for (uint32_t p = 0; p < numPartitions; ++p) mPartitionStart[p + 1] += mPartitionStart[p];
+
+		// Scatter, using mPartitionStart[p] as the insertion point of partition p, which moves it to the start of p + 1
+		for (uint32_t k = 0; k < numSpheres; ++k)
+		{
+			const auto i = firstSphere + k;
+			const auto to = mPartitionStart[mSpherePartition[k]]++;
+			mSpheres[to] = i;
+			mPositionX[to] = spheres.mPositionX[i];
+			mPositionY[to] = spheres.mPositionY[i];
+#ifdef _3D
+			mPositionZ[to] = spheres.mPositionZ[i];
+#endif
+			mRadius[to] = spheres.mRadius[i];
+		}
+
+		// Shift back so mPartitionStart[p] is the start of partition p again
+		for (uint32_t p = numPartitions; p > 0; --p) mPartitionStart[p] = mPartitionStart[p - 1];
+		mPartitionStart[0] = 0;
+	}
+};
@@ -0,0 +1,251 @@
+#pragma once
+
+#include "Common.h"
+
+// Continuous collision detection (--ccd 1)
+// The discrete frame only tests the positions at the start of the frame, so a sphere moving farther than the
+// collision range of a small sphere in one frame can pass through it. In continuous mode every moving sphere is swept
+// over the frame instead: the time of impact with every candidate is solved from their relative motion, and the
+// sphere is moved to its earliest contact, where it bounces, rather than through the whole step
+// The candidates are found with the broadphase in use, queried with the box the sphere sweeps during the frame, grown
+// by the largest distance any sphere travels on one axis (gSweptMargin), so the candidates of the sphere include
+// every sphere it could meet during the frame
+// Every sphere is assumed to move along its velocity for the whole frame, the contacts of the spheres it meets are
+// not taken into account, and the time left after a contact is not simulated: the sphere waits at the contact point
+// for the next frame
+
+// Time of impact of the sphere with other during the frame, as a fraction of the frame in [0, 1]
+// Solves |d + w t| = R for the smallest t, with d the offset from the sphere to other, w their relative displacement
+// over the frame and R the collision distance. Spheres already in contact only collide while they move closer, so
+// spheres that bounced apart are left to separate
+// Returns false if they do not meet during the frame, otherwise the time and the offset between the centres at that
+// time, pointing from the sphere to other
+inline bool SweptTimeOfImpact(uint32_t sphere, uint32_t other, float& time, CVector& normal)
+{
+	const auto& spheres = gSpheresCollisionInfo;
+
+	COUNT_PAIR_TEST();
+	const auto d = spheres.Position(other) - spheres.Position(sphere);
+	// The blocking spheres have a velocity in the store but never move
+#ifdef _3D
+	const auto otherVelocity = spheres.IsBlocking(other) ? CVector3(0.f, 0.f, 0.f) : spheres.Velocity(other);
+#else
+	const auto otherVelocity = spheres.IsBlocking(other) ? CVector2(0.f, 0.f) : spheres.Velocity(other);
+#endif
+	const auto w = (otherVelocity - spheres.Velocity(sphere)) * totalTime;
+	const auto rad = (spheres.mRadius[other] + spheres.mRadius[sphere]) * KCollisionRangeScale;
+
+	const auto b = Dot(d, w);
+	if (b >= 0.f) return false;		// Not moving closer
+
+	const auto c = Dot(d, d) - rad * rad;
+	if (c <= 0.f)
+	{
+		time = 0.f;
+		normal = d;
+		return true;
+	}
+
+	const auto a = Dot(w, w);
+	const auto discriminant = b * b - a * c;
+	if (discriminant < 0.f) return false;
+
+	// c > 0 and b < 0, so the smaller root is positive
+	time = (-b - std::sqrt(discriminant)) / a;
+	if (time > 1.f) return false;
+
+	normal = d + w * time;
+	return true;
+}
+
+// Time at which the centre of the sphere reaches the wall it moves towards on one axis, the walls being the bounds
+// where CollisionWithWalls bounces the spheres. Returns false if it does not during the frame
+inline bool SweptWallTime(float position, float velocity, float& time)
+{
+	const auto range = gSettings.mRangeSpawn;
+	const auto step = velocity * totalTime;
+
+	if (step > 0.f)
+		time = (range - position) / step;
+	else if (step < 0.f)
+		time = (-range - position) / step;
+	else
+		return false;
+
+	time = std::max(time, 0.f);
+	return time <= 1.f;
+}
+
+// Box the sphere sweeps during the frame, grown so it contains the start of every sphere it can meet
+inline SAABB SweptBox(uint32_t sphere)
+{
+	auto box = SAABB::OfSphere(sphere, gSettings.mRangeRadius * KCollisionRangeScale + gSweptMargin);
+	box.Extend(gSpheresCollisionInfo.Velocity(sphere) * totalTime);
+	return box;
+}
+
+// Largest distance travelled on one axis by a moving sphere during the frame
+inline float MaxSweptDistance()
+{
+	const auto& spheres = gSpheresCollisionInfo;
+
+	float speed = 0.f;
+	for (auto s = spheres.mNumBlocking; s < spheres.Size(); ++s)
+	{
+		speed = std::max({ speed, std::abs(spheres.mVelocityX[s]), std::abs(spheres.mVelocityY[s]) });
+#ifdef _3D
+		speed = std::max(speed, std::abs(spheres.mVelocityZ[s]));
+#endif
+	}
+	return speed * totalTime;
+}
+
+// Calls visit(other) for every sphere of the broadphase in use (and of gBlockerBVH) that can be in the box, each once
+template<typename Visit>
+inline void ForEachSweptCandidate(const SAABB& box, Visit visit)
+{
+#ifdef _3D
+	const auto minZ = box.mMin.z, maxZ = box.mMax.z;
+#else
+	const auto minZ = 0.f, maxZ = 0.f;
+#endif
+
+	switch (gSettings.mBroadphase)
+	{
+	case EBroadphase::Grid:
+	{
+		const auto& grid = *gGrid;
+		const auto x0 = grid.PartitionCoordinate(box.mMin.x), x1 = grid.PartitionCoordinate(box.mMax.x);
+		const auto y0 = grid.PartitionCoordinate(box.mMin.y), y1 = grid.PartitionCoordinate(box.mMax.y);
+#ifdef _3D
+		const auto z0 = grid.PartitionCoordinate(minZ), z1 = grid.PartitionCoordinate(maxZ);
+#else
+		const auto z0 = 0, z1 = 0;
+#endif
+		for (auto z = z0; z <= z1; ++z)
+			for (auto y = y0; y <= y1; ++y)
+				for (auto x = x0; x <= x1; ++x)
+					for (const auto other : grid.mPartitions[grid.to1D(x, y, z)]) visit(other);
+		break;
+	}
+	case EBroadphase::CompactGrid:
+	{
+		// A row of partitions is one span of the sorted spheres
+		const auto& grid = *gCompactGrid;
+		const auto x0 = grid.PartitionCoordinate(box.mMin.x), x1 = grid.PartitionCoordinate(box.mMax.x);
+		const auto y0 = grid.PartitionCoordinate(box.mMin.y), y1 = grid.PartitionCoordinate(box.mMax.y);
+#ifdef _3D
+		const auto z0 = grid.PartitionCoordinate(minZ), z1 = grid.PartitionCoordinate(maxZ);
+#else
+		const auto z0 = 0, z1 = 0;
+#endif
+		for (auto z = z0; z <= z1; ++z)
+		{
+			for (auto y = y0; y <= y1; ++y)
+			{
+				const auto end = grid.mPartitionStart[grid.PartitionIndex(x1, y, z) + 1];
+				for (auto k = grid.mPartitionStart[grid.PartitionIndex(x0, y, z)]; k != end; ++k) visit(grid.mSpheres[k]);
+			}
+		}
+		break;
+	}
+	case EBroadphase::HashGrid:
+	{
+		const auto& grid = *gHashGrid;
+		const auto first = grid.CellOf(box.mMin.x, box.mMin.y, minZ);
+		const auto last = grid.CellOf(box.mMax.x, box.mMax.y, maxZ);
+		for (auto z = first.z; z <= last.z; ++z)
+		{
+			for (auto y = first.y; y <= last.y; ++y)
+			{
+				for (auto x = first.x; x <= last.x; ++x)
+				{
+					const auto cell = grid.Find({ x, y, z });
+					if (cell == HashGrid::KEmpty) continue;
+					for (auto k = grid.mCellStart[cell]; k != grid.mCellStart[cell + 1]; ++k) visit(grid.mSpheres[k]);
+				}
+			}
+		}
+		break;
+	}
+	case EBroadphase::SweepAndPrune:
+		for (const auto* list : { &gSweepAndPrune->mMoving, &gSweepAndPrune->mBlocking })
+		{
+			for (auto k = list->FirstOverlapping(box.mMin.x); k < list->Size() && list->mMin[k] <= box.mMax.x; ++k)
+			{
+				if (list->mMax[k] >= box.mMin.x) visit(list->mSpheres[k]);
+			}
+		}
+		break;
+	case EBroadphase::AABBTree:
+		gAABBTree->Query(box, visit);
+		break;
+	case EBroadphase::LooseTree:
+		gLooseTree->Query(box, [&](const LooseTree::SNode& node)
+		{
+			for (const auto other : node.mSpheres) visit(other);
+		});
+		break;
+	}
+
+	if (gSettings.mBlockerBVH) gBlockerBVH->QueryBox(box, visit);
+}
+
+// Finds the earliest contact of the moving spheres [first, last) of the store during the frame, and the contacts to
+// log. The contact of a sphere is written to its own mContact, mContactNormal and mContactTime, the wall being the
+// sphere itself as for CollisionSpatialPartitioning. A pair of moving spheres is found by both, it is only added to
+// the contacts by the one with the higher index
+// At equal times the sphere bounces off the wall, then off the sphere of lowest index, so the result does not depend
+// on the order the broadphase gives the candidates in
+inline void FindImpacts(uint32_t first, uint32_t last, std::vector<SContact>& contacts)
+{
+	auto& spheres = gSpheresCollisionInfo;
+
+	for (auto sphere = first; sphere != last; ++sphere)
+	{
+		auto contact = KNoCollision;
+		auto contactTime = 1.f;
+		CVector contactNormal;
+
+		const auto hitWall = [&](float position, float velocity, const CVector& normal)
+		{
+			float time;
+			if (SweptWallTime(position, velocity, time) && (contact == KNoCollision || time < contactTime))
+			{
+				contact = static_cast<int>(sphere);
+				contactTime = time;
+				contactNormal = normal;
+			}
+		};
+#ifdef _3D
+		hitWall(spheres.mPositionX[sphere], spheres.mVelocityX[sphere], CVector3(1.f, 0.f, 0.f));
+		hitWall(spheres.mPositionY[sphere], spheres.mVelocityY[sphere], CVector3(0.f, 1.f, 0.f));
+		hitWall(spheres.mPositionZ[sphere], spheres.mVelocityZ[sphere], CVector3(0.f, 0.f, 1.f));
+#else
+		hitWall(spheres.mPositionX[sphere], spheres.mVelocityX[sphere], CVector2(1.f, 0.f));
+		hitWall(spheres.mPositionY[sphere], spheres.mVelocityY[sphere], CVector2(0.f, 1.f));
+#endif
+
+		ForEachSweptCandidate(SweptBox(sphere), [&](uint32_t other)
+		{
+			float time;
+			CVector normal;
+			if (other == sphere || !SweptTimeOfImpact(sphere, other, time, normal)) return;
+
+			if (spheres.IsBlocking(other) || other < sphere) AddContact(contacts, sphere, other, normal);
+
+			const auto earlier = contact == KNoCollision || time < contactTime ||
+				(time == contactTime && contact != static_cast<int>(sphere) && static_cast<int>(other) < contact);
+			if (earlier)
+			{
+				contact = static_cast<int>(other);
+				contactTime = time;
+				contactNormal = normal;
+			}
+		});
+
+		spheres.mContact[sphere] = contact;
+		spheres.mContactNormal[sphere] = contactNormal;
+		spheres.mContactTime[sphere] = contactTime;
+	}
+}
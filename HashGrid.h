@@ -0,0 +1,168 @@
+#pragma once
+
+#include "Common.h"
+
+// Grid with no bounds, rebuilt every frame like CompactGrid, where only the occupied cells exist
+// The integer coordinates of a cell are mapped to its index by an open addressing hash table (linear probing), and
+// the spheres of the cells are stored CSR style as in CompactGrid: the spheres of cell c are
+// mSpheres[mCellStart[c], mCellStart[c + 1]), with their positions and radii copied in the same order
+// Memory only grows with the number of occupied cells, and the spheres that leave the world are not clamped into the
+// cells on its border
+class HashGrid
+{
+
+public:
+
+	struct SCellKey
+	{
+		int x, y, z;
+
+		bool operator==(const SCellKey& k) const { return x == k.x && y == k.y && z == k.z; }
+	};
+
+	static constexpr int KEmpty = -1;
+
+	HashGrid() :
+		mCellSize(gSettings.mHashCellSize)
+	{
+	}
+
+	float mCellSize;
+
+	// Hash table, the number of slots is a power of two kept at least twice the number of cells
+	std::vector<SCellKey> mSlotKeys;
+	std::vector<int> mSlotCells;		// Index of the cell of the slot, KEmpty for the free slots
+
+	std::vector<SCellKey> mCellKeys;	// Coordinates of every cell
+	std::vector<uint32_t> mCellStart;	// One more than the number of cells, the last is the number of spheres
+
+	// Sorted by cell
+	std::vector<uint32_t> mSpheres;		// Index of the sphere in gSpheresCollisionInfo
+	std::vector<float> mPositionX;
+	std::vector<float> mPositionY;
+#ifdef _3D
+	std::vector<float> mPositionZ;
+#endif
+	std::vector<float> mRadius;
+
+	std::vector<uint32_t> mSphereCell;	// Cell of every sphere sorted, only used while building
+
+
+	uint32_t NumCells() const { return static_cast<uint32_t>(mCellKeys.size()); }
+
+	SCellKey CellOf(float x, float y, float z) const
+	{
+		return { static_cast<int>(std::floor(x / mCellSize)), static_cast<int>(std::floor(y / mCellSize)), static_cast<int>(std::floor(z / mCellSize)) };
+	}
+
+	// Index of the cell, KEmpty if no sphere is in it
+	int Find(const SCellKey& key) const
+	{
+		const auto mask = static_cast<uint32_t>(mSlotKeys.size()) - 1;
+		for (auto slot = Hash(key) & mask; ; slot = (slot + 1) & mask)
+		{
+			if (mSlotCells[slot] == KEmpty) return KEmpty;
+			if (mSlotKeys[slot] == key) return mSlotCells[slot];
+		}
+	}
+
+	// Counting sort of the spheres by cell, only the moving ones when the blocking ones are in the BVH
+	void Build()
+	{
+		const auto& spheres = gSpheresCollisionInfo;
+		const auto firstSphere = gSettings.mBlockerBVH ? spheres.mNumBlocking : 0u;
+		const auto numSpheres = spheres.Size() - firstSphere;
+
+		mSphereCell.resize(numSpheres);
+		mSpheres.resize(numSpheres);
+		mPositionX.resize(numSpheres);
+		mPositionY.resize(numSpheres);
+#ifdef _3D
+		mPositionZ.resize(numSpheres);
+#endif
+		mRadius.resize(numSpheres);
+
+		// Start from the size of the last frame, the number of occupied cells changes little between frames
+		if (mSlotKeys.empty()) Rehash(64);
+		std::fill(mSlotCells.begin(), mSlotCells.end(), KEmpty);
+		mCellKeys.clear();
+		mCellStart.assign(1, 0u);
+
+		// Find or add the cell of every sphere, counting the spheres of every cell
+		for (uint32_t k = 0; k < numSpheres; ++k)
+		{
+			const auto i = firstSphere + k;
+#ifdef _3D
+			const auto z = spheres.mPositionZ[i];
+#else
+			const auto z = 0.f;
+#endif
+			const auto cell = FindOrAdd(CellOf(spheres.mPositionX[i], spheres.mPositionY[i], z));
+			mSphereCell[k] = cell;
+			++mCellStart[cell + 1];
+		}
+
+		// Prefix sum, mCellStart[c + 1] becomes the end of cell c
+		for (uint32_t c = 0; c < NumCells(); ++c) mCellStart[c + 1] += mCellStart[c];
+
+		// Scatter, using mCellStart[c] as the insertion point of cell c, which moves it to the start of c + 1
+		for (uint32_t k = 0; k < numSpheres; ++k)
+		{
+			const auto i = firstSphere + k;
+			const auto to = mCellStart[mSphereCell[k]]++;
+			mSpheres[to] = i;
+			mPositionX[to] = spheres.mPositionX[i];
+			mPositionY[to] = spheres.mPositionY[i];
+#ifdef _3D
+			mPositionZ[to] = spheres.mPositionZ[i];
+#endif
+			mRadius[to] = spheres.mRadius[i];
+		}
+
+		// Shift back so mCellStart[c] is the start of cell c again
+		for (auto c = NumCells(); c > 0; --c) mCellStart[c] = mCellStart[c - 1];
+		mCellStart[0] = 0;
+	}
+
+private:
+
+	static uint32_t Hash(const SCellKey& key)
+	{
+		return static_cast<uint32_t>(key.x) * 73856093u ^ static_cast<uint32_t>(key.y) * 19349663u ^ static_cast<uint32_t>(key.z) * 83492791u;
+	}
+
+	uint32_t FindOrAdd(const SCellKey& key)
+	{
+		const auto mask = static_cast<uint32_t>(mSlotKeys.size()) - 1;
+		auto slot = Hash(key) & mask;
+		for (; mSlotCells[slot] != KEmpty; slot = (slot + 1) & mask)
+		{
+			if (mSlotKeys[slot] == key) return static_cast<uint32_t>(mSlotCells[slot]);
+		}
+
+		const auto cell = NumCells();
+		mSlotKeys[slot] = key;
+		mSlotCells[slot] = static_cast<int>(cell);
+		mCellKeys.push_back(key);
+		mCellStart.push_back(0u);
+
+		// Keep the load factor under one half so the probe sequences stay short
+		if (2 * NumCells() > mSlotKeys.size()) Rehash(2 * mSlotKeys.size());
+		return cell;
+	}
+
+	void Rehash(size_t numSlots)
+	{
+		mSlotKeys.assign(numSlots, SCellKey{});
+		mSlotCells.assign(numSlots, KEmpty);
+
+		const auto mask = static_cast<uint32_t>(numSlots) - 1;
+		for (uint32_t cell = 0; cell < NumCells(); ++cell)
+		{
+			auto slot = Hash(mCellKeys[cell]) & mask;
+			while (mSlotCells[slot] != KEmpty) slot = (slot + 1) & mask;
+			mSlotKeys[slot] = mCellKeys[cell];
+			mSlotCells[slot] = static_cast<int>(cell);
+		}
+	}
+};
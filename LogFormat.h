@@ -0,0 +1,75 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Binary collision log written by LogWriter and rendered to text by LogToText
+// A file is a header, the name of every sphere indexed by its id, then the records until the end of the file. Every
+// file of a rotated log starts with its own header and names, so it can be read alone
+// Numbers are stored in the byte order of the machine that wrote the file
+
+constexpr char     KLogMagic[4] = { 'S', 'L', 'O', 'G' };
+constexpr uint32_t KLogVersion = 1;
+
+struct SLogFileHeader
+{
+	char     mMagic[4];
+	uint32_t mVersion;
+	uint32_t mNumNames;		// Followed by this many names, each a uint16_t length and the characters
+};
+
+struct SLogRecord
+{
+	int64_t  mTime;			// Seconds since the epoch
+	uint32_t mFrame;
+	uint32_t mId[2];		// Ids of the two spheres, index of their name
+	uint8_t  mHealth[2];	// Health remaining after the collision
+	uint8_t  mPadding[2];
+};
+static_assert(sizeof(SLogRecord) == 24, "The records are written as they are in memory");
+
+inline void WriteLogHeader(std::ostream& out, const std::vector<std::string>& names)
+{
+	SLogFileHeader header;
+	std::copy(KLogMagic, KLogMagic + 4, header.mMagic);
+	header.mVersion = KLogVersion;
+	header.mNumNames = static_cast<uint32_t>(names.size());
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+	for (const auto& name : names)
+	{
+		const auto length = static_cast<uint16_t>(name.size());
+		out.write(reinterpret_cast<const char*>(&length), sizeof(length));
+		out.write(name.data(), length);
+	}
+}
+
+// Returns false if the stream does not start with a log header of this version
+inline bool ReadLogHeader(std::istream& in, std::vector<std::string>& names)
+{
+	SLogFileHeader header;
+	if (!in.read(reinterpret_cast<char*>(&header), sizeof(header))) return false;
+	if (!std::equal(KLogMagic, KLogMagic + 4, header.mMagic) || header.mVersion != KLogVersion) return false;
+
+	names.resize(header.mNumNames);
+	for (auto& name : names)
+	{
+		uint16_t length;
+		if (!in.read(reinterpret_cast<char*>(&length), sizeof(length))) return false;
+		name.resize(length);
+		if (!in.read(&name[0], length)) return false;
+	}
+	return true;
+}
+
+// Same line as the text log of the previous versions
+inline std::string FormatLogRecord(const SLogRecord& record, const std::vector<std::string>& names)
+{
+	auto s = "[" + std::to_string(record.mTime) + "] Collision: " + names[record.mId[0]] + ", Health : " + std::to_string(record.mHealth[0]);
+	s.append(" with " + names[record.mId[1]] + ", Health : " + std::to_string(record.mHealth[1]));
+	return s;
+}
@@ -0,0 +1,55 @@
+// LogToText.cpp: renders the binary collision log written by the _LOG builds as text
+// The lines are the same as the Output.txt of the previous versions. Takes the path the log was written to and reads
+// the files of the rotated log in order, PATH.0.bin, PATH.1.bin, ... until one is missing, the runs one after another:
+//     AssignmentLogToText Collisions > Output.txt
+
+#include "LogFormat.h"
+
+#include <fstream>
+#include <iostream>
+
+int main(int argc, char** argv)
+{
+	if (argc != 2)
+	{
+		std::cerr << "Usage: " << argv[0] << " PATH\n";
+		return 1;
+	}
+
+	std::ios_base::sync_with_stdio(false);
+
+	uint32_t index = 0;
+	for (; ; ++index)
+	{
+		const auto fileName = std::string(argv[1]) + "." + std::to_string(index) + ".bin";
+		std::ifstream file(fileName, std::ios::binary);
+		if (!file) break;
+
+		std::vector<std::string> names;
+		if (!ReadLogHeader(file, names))
+		{
+			std::cerr << fileName << ": not a collision log\n";
+			return 1;
+		}
+
+		// A file cut short by a crash ends with a partial record, which is left out
+		SLogRecord record;
+		while (file.read(reinterpret_cast<char*>(&record), sizeof(record)))
+		{
+			if (record.mId[0] >= names.size() || record.mId[1] >= names.size())
+			{
+				std::cerr << fileName << ": sphere id out of range\n";
+				return 1;
+			}
+			std::cout << FormatLogRecord(record, names) << '\n';
+		}
+	}
+
+	if (index == 0)
+	{
+		std::cerr << "No log file " << argv[1] << ".0.bin\n";
+		return 1;
+	}
+
+	return 0;
+}
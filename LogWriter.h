@@ -0,0 +1,162 @@
+#pragma once
+
+#include "LogFormat.h"
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <thread>
+
+// Queue between one producer and one consumer thread, without locks
+// Push and Pop return false when the queue is full or empty
+template<typename T, uint32_t KCapacity>
+class SpscQueue
+{
+
+public:
+
+	bool Push(const T& item)
+	{
+		const auto tail = mTail.load(std::memory_order_relaxed);
+		if (tail - mHead.load(std::memory_order_acquire) == KCapacity) return false;
+
+		mItems[tail % KCapacity] = item;
+		mTail.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool Pop(T& item)
+	{
+		const auto head = mHead.load(std::memory_order_relaxed);
+		if (head == mTail.load(std::memory_order_acquire)) return false;
+
+		item = mItems[head % KCapacity];
+		mHead.store(head + 1, std::memory_order_release);
+		return true;
+	}
+
+private:
+
+	alignas(64) std::atomic<uint32_t> mHead{ 0 };	// Written by the consumer
+	alignas(64) std::atomic<uint32_t> mTail{ 0 };	// Written by the producer
+	T mItems[KCapacity];
+};
+
+// Writes the collision log on a background thread, so the frame does not wait for the disk
+// The main thread fills a batch with the records of a frame and submits it, the writer thread appends it to the file
+// and hands the batch back. The batches go back and forth through two lock-free queues and keep their memory, so
+// logging a frame does not allocate once the batches are warm. If the writer falls KNumBatches frames behind, the
+// main thread waits for a batch to come back
+// The file is rotated when it grows past the maximum size: path.0.bin, path.1.bin, ... (see LogFormat.h)
+// Nothing already written is overwritten: a run starts after the last file left by the previous runs, so the log of
+// every run is kept and read in order
+class LogWriter
+{
+
+public:
+
+	using SBatch = std::vector<SLogRecord>;
+
+	static constexpr uint32_t KNumBatches = 64;
+
+	LogWriter(const std::string& path, uint64_t maxFileSize, std::vector<std::string> names) :
+		mPath(path),
+		mMaxFileSize(maxFileSize),
+		mNames(std::move(names))
+	{
+		for (auto& batch : mBatches) mFree.Push(&batch);
+		mThread = std::thread(&LogWriter::Run, this);
+	}
+
+	// Writes the batches still in the queue before returning
+	~LogWriter()
+	{
+		mStop.store(true, std::memory_order_release);
+		mThread.join();
+	}
+
+	// Main thread only, returns an empty batch to fill
+	SBatch& AcquireBatch()
+	{
+		SBatch* batch;
+		while (!mFree.Pop(batch)) std::this_thread::yield();
+		batch->clear();
+		return *batch;
+	}
+
+	// Main thread only, queues the batch of the next frame
+	void Submit(SBatch& batch)
+	{
+		mFull.Push(&batch);
+	}
+
+private:
+
+	void Run()
+	{
+		OpenNextFile();
+
+		while (true)
+		{
+			// Loaded before the queue, so when the stop is seen every batch submitted before it can be popped
+			const auto stop = mStop.load(std::memory_order_acquire);
+
+			SBatch* batch;
+			if (mFull.Pop(batch))
+			{
+				Write(*batch);
+				mFree.Push(batch);
+				continue;
+			}
+
+			if (stop) break;
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+
+		mFile.close();
+	}
+
+	void Write(SBatch& batch)
+	{
+		for (auto& record : batch) record.mFrame = mFrame;
+		++mFrame;
+
+		const auto size = batch.size() * sizeof(SLogRecord);
+		mFile.write(reinterpret_cast<const char*>(batch.data()), size);
+		mFileSize += size;
+
+		if (mFileSize >= mMaxFileSize) OpenNextFile();
+	}
+
+	void OpenNextFile()
+	{
+		if (mFile.is_open()) mFile.close();
+
+		while (std::ifstream(FileName(mFileIndex))) ++mFileIndex;
+		mFile.open(FileName(mFileIndex++), std::ios::binary | std::ios::app);
+		WriteLogHeader(mFile, mNames);
+		mFileSize = static_cast<uint64_t>(mFile.tellp());
+	}
+
+	std::string FileName(uint32_t index) const
+	{
+		return mPath + "." + std::to_string(index) + ".bin";
+	}
+
+	std::string mPath;
+	uint64_t mMaxFileSize;
+	std::vector<std::string> mNames;
+
+	SBatch mBatches[KNumBatches];
+	SpscQueue<SBatch*, KNumBatches> mFull;	// Main thread to writer
+	SpscQueue<SBatch*, KNumBatches> mFree;	// Writer to main thread
+
+	std::atomic<bool> mStop{ false };
+	std::thread mThread;
+
+	// Writer thread only
+	std::ofstream mFile;
+	uint64_t mFileSize = 0;
+	uint32_t mFileIndex = 0;
+	uint32_t mFrame = 0;
+};
@@ -0,0 +1,280 @@
+#pragma once
+
+#include "AABB.h"
+
+// Loose quadtree (octree in 3D) broadphase, for scenes where the spheres are clustered
+// A node covers a square cell of the world and its loose box is the cell grown by half its size on every side, so a
+// sphere whose centre is in the cell and whose collision range is not larger than half the cell fits in the loose box.
+// Every sphere is stored in the deepest node it fits in. A node is only split when more than KSplitThreshold
+// spheres are stored in it, so the tree is only deep where the spheres are crowded
+// The nodes are pooled in one array, the children of a node are consecutive. Spheres outside the world stay in the root
+// Once the children of a node are all empty leaves they are merged back into it, and their block is reused by the next
+// split, so the tree does not keep the nodes of the regions the spheres left
+class LooseTree
+{
+
+public:
+
+	static constexpr int KNull = -1;
+#ifdef _3D
+	static constexpr int KNumChildren = 8;
+#else
+	static constexpr int KNumChildren = 4;
+#endif
+	static constexpr uint32_t KSplitThreshold = 16;
+	static constexpr int KMaxDepth = 16;
+
+	struct SNode
+	{
+		CVector  mCentre;
+		float    mHalfSize;		// Half the size of the cell, the loose box is twice as large
+		int      mDepth;
+		int      mFirstChild;	// KNull for the leaves
+		int      mParent;		// KNull for the root
+		std::vector<uint32_t> mSpheres;
+	};
+
+	std::vector<SNode> mNodes;
+
+	std::vector<int> mNode;				// Node of every sphere of the store, KNull if the sphere is not in the tree
+	std::vector<int> mIndexInNode;		// Position of the sphere in the list of its node
+
+
+	// Inserts all the spheres of the store, only the moving ones when the blocking ones are in the BVH
+	void Build()
+	{
+		const auto& spheres = gSpheresCollisionInfo;
+
+		mNodes.clear();
+		mNodes.emplace_back();
+#ifdef _3D
+		mNodes[0].mCentre = CVector(0.f, 0.f, 0.f);
+#else
+		mNodes[0].mCentre = CVector(0.f, 0.f);
+#endif
+		mNodes[0].mHalfSize = gSettings.mRangeSpawn;
+		mNodes[0].mDepth = 0;
+		mNodes[0].mFirstChild = KNull;
+		mNodes[0].mParent = KNull;
+		mFreeBlocks.clear();
+
+		mNode.assign(spheres.Size(), KNull);
+		mIndexInNode.assign(spheres.Size(), KNull);
+
+		for (auto s = gSettings.mBlockerBVH ? spheres.mNumBlocking : 0u; s < spheres.Size(); ++s) Add(s);
+	}
+
+	void Add(uint32_t sphere)
+	{
+		const auto& spheres = gSpheresCollisionInfo;
+		const auto centre = spheres.Position(sphere);
+		const auto range = spheres.mRadius[sphere] * KCollisionRangeScale;
+
+		auto node = 0;
+		if (InCell(0, centre))
+		{
+			while (true)
+			{
+				if (mNodes[node].mFirstChild == KNull)
+				{
+					if (mNodes[node].mSpheres.size() < KSplitThreshold || mNodes[node].mDepth >= KMaxDepth || mNodes[node].mHalfSize * 0.5f < range) break;
+					Split(node);
+				}
+
+				const auto child = ChildContaining(node, centre);
+				if (mNodes[child].mHalfSize < range) break;
+				node = child;
+			}
+		}
+
+		auto& list = mNodes[node].mSpheres;
+		mNode[sphere] = node;
+		mIndexInNode[sphere] = static_cast<int>(list.size());
+		list.push_back(sphere);
+	}
+
+	void Remove(uint32_t sphere)
+	{
+		const auto node = mNode[sphere];
+		auto& list = mNodes[node].mSpheres;
+		const auto index = mIndexInNode[sphere];
+
+		list[index] = list.back();
+		list.pop_back();
+
+		if (index < static_cast<int>(list.size())) mIndexInNode[list[index]] = index;
+		mNode[sphere] = KNull;
+		mIndexInNode[sphere] = KNull;
+
+		if (list.empty()) Merge(mNodes[node].mParent);
+	}
+
+	// Points the nodes to the new index of the spheres [first, first + order.size()) after the store was permuted by
+	// SSphereStore::Permute
+	void Renumber(uint32_t first, const std::vector<uint32_t>& order)
+	{
+		if (mNode.empty()) return;	// Not built yet
+
+		SSphereStore::PermuteColumn(mNode, first, order);
+		SSphereStore::PermuteColumn(mIndexInNode, first, order);
+		for (auto s = first; s != first + order.size(); ++s)
+		{
+			if (mNode[s] != KNull) mNodes[mNode[s]].mSpheres[mIndexInNode[s]] = s;
+		}
+	}
+
+	// Removes the spheres removed by SSphereStore::SwapRemoveOrder and points the nodes to the new index of the others
+	void Compact(const std::vector<uint32_t>& newIndex)
+	{
+		if (mNode.empty()) return;	// Not built yet
+
+		for (uint32_t s = 0; s < newIndex.size(); ++s)
+		{
+			if (newIndex[s] == SSphereStore::KRemoved && mNode[s] != KNull) Remove(s);
+		}
+		for (uint32_t s = 0; s < newIndex.size(); ++s)
+		{
+			if (newIndex[s] != SSphereStore::KRemoved && mNode[s] != KNull) mNodes[mNode[s]].mSpheres[mIndexInNode[s]] = newIndex[s];
+		}
+		SSphereStore::CompactColumn(mNode, newIndex);
+		SSphereStore::CompactColumn(mIndexInNode, newIndex);
+	}
+
+	// True if the sphere must be removed and added again: its centre left the cell of its node, or it is in the root
+	// and would now go down the tree, as a sphere stays in the root while its centre is outside the world
+	bool LeftNode(uint32_t sphere) const
+	{
+		const auto& spheres = gSpheresCollisionInfo;
+		const auto node = mNode[sphere];
+		const auto centre = spheres.Position(sphere);
+		if (node != 0) return !InCell(node, centre);
+
+		const auto firstChild = mNodes[0].mFirstChild;
+		return firstChild != KNull && InCell(0, centre) && mNodes[firstChild].mHalfSize >= spheres.mRadius[sphere] * KCollisionRangeScale;
+	}
+
+	// Calls visit(node) for every node whose loose box overlaps the box, the root is always visited as it holds the
+	// spheres outside the world
+	template<typename Visit>
+	void Query(const SAABB& box, Visit visit) const
+	{
+		int stack[KMaxDepth * KNumChildren + 1];
+		auto top = 0;
+		stack[top++] = 0;
+
+		while (top > 0)
+		{
+			const auto index = stack[--top];
+			const auto& node = mNodes[index];
+			if (index != 0 && !LooseBox(index).Overlaps(box)) continue;
+
+			visit(node);
+
+			if (node.mFirstChild != KNull)
+			{
+				for (auto c = 0; c < KNumChildren; ++c) stack[top++] = node.mFirstChild + c;
+			}
+		}
+	}
+
+	SAABB LooseBox(int node) const
+	{
+		const auto size = mNodes[node].mHalfSize * 2.f;
+#ifdef _3D
+		const CVector grow(size, size, size);
+#else
+		const CVector grow(size, size);
+#endif
+		return { mNodes[node].mCentre - grow, mNodes[node].mCentre + grow };
+	}
+
+private:
+
+	bool InCell(int node, const CVector& p) const
+	{
+		const auto& n = mNodes[node];
+#ifdef _3D
+		if (p.z < n.mCentre.z - n.mHalfSize || p.z >= n.mCentre.z + n.mHalfSize) return false;
+#endif
+		return p.x >= n.mCentre.x - n.mHalfSize && p.x < n.mCentre.x + n.mHalfSize &&
+			   p.y >= n.mCentre.y - n.mHalfSize && p.y < n.mCentre.y + n.mHalfSize;
+	}
+
+	// Child of the node whose cell contains the point, the point must be in the cell of the node
+	int ChildContaining(int node, const CVector& p) const
+	{
+		const auto& n = mNodes[node];
+		auto child = (p.x >= n.mCentre.x ? 1 : 0) + (p.y >= n.mCentre.y ? 2 : 0);
+#ifdef _3D
+		child += p.z >= n.mCentre.z ? 4 : 0;
+#endif
+		return n.mFirstChild + child;
+	}
+
+	// Creates the children of a leaf and moves down the spheres that fit in them
+	void Split(int node)
+	{
+		const auto halfSize = mNodes[node].mHalfSize * 0.5f;
+		const auto centre = mNodes[node].mCentre;
+		const auto depth = mNodes[node].mDepth + 1;
+
+		int first;
+		if (mFreeBlocks.empty())
+		{
+			first = static_cast<int>(mNodes.size());
+			mNodes.resize(mNodes.size() + KNumChildren);
+		}
+		else
+		{
+			first = mFreeBlocks.back();
+			mFreeBlocks.pop_back();
+		}
+
+		for (auto c = 0; c < KNumChildren; ++c)
+		{
+			auto& child = mNodes[first + c];
+			child.mCentre = centre;
+			child.mCentre.x += c & 1 ? halfSize : -halfSize;
+			child.mCentre.y += c & 2 ? halfSize : -halfSize;
+#ifdef _3D
+			child.mCentre.z += c & 4 ? halfSize : -halfSize;
+#endif
+			child.mHalfSize = halfSize;
+			child.mDepth = depth;
+			child.mFirstChild = KNull;
+			child.mParent = node;
+		}
+		mNodes[node].mFirstChild = first;
+
+		const auto& spheres = gSpheresCollisionInfo;
+		const auto list = std::move(mNodes[node].mSpheres);
+		mNodes[node].mSpheres.clear();
+		for (const auto s : list)
+		{
+			const auto child = spheres.mRadius[s] * KCollisionRangeScale <= halfSize ? ChildContaining(node, spheres.Position(s)) : node;
+			auto& childList = mNodes[child].mSpheres;
+			mNode[s] = child;
+			mIndexInNode[s] = static_cast<int>(childList.size());
+			childList.push_back(s);
+		}
+	}
+
+	// Frees the children of the node if they are all empty leaves, then goes up while the node left is an empty leaf
+	void Merge(int node)
+	{
+		for (; node != KNull; node = mNodes[node].mParent)
+		{
+			const auto first = mNodes[node].mFirstChild;
+			for (auto c = 0; c < KNumChildren; ++c)
+			{
+				if (mNodes[first + c].mFirstChild != KNull || !mNodes[first + c].mSpheres.empty()) return;
+			}
+
+			mNodes[node].mFirstChild = KNull;
+			mFreeBlocks.push_back(first);
+			if (!mNodes[node].mSpheres.empty()) return;
+		}
+	}
+
+	std::vector<int> mFreeBlocks;		// First node of the blocks of children freed by Merge
+};
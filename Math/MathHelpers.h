@@ -6,10 +6,11 @@
 #define _MATH_HELPERS_H_DEFINED_
 
 #include <cmath>
+#include <cstring>
 #include <stdint.h>
 
 // Surprisingly, pi is not *officially* defined anywhere in C++
-const float PI = 3.14159265359f;
+constexpr float PI = 3.14159265359f;
 
 // Test if a float value is approximately 0
 // Epsilon value is the range around zero that is considered equal to zero
@@ -27,15 +28,15 @@ inline float InvSqrt(const float x)
 
 inline float Q_rsqrt(float number)
 {
-	long i;
+	int32_t i;
 	float x2, y;
 	const float threehalfs = 1.5F;
 
 	x2 = number * 0.5F;
 	y = number;
-	i = *(long*)&y;						// evil floating point bit level hacking
+	memcpy(&i, &y, sizeof(i));				// evil floating point bit level hacking (long is 64 bits on Linux)
 	i = 0x5f3759df - (i >> 1);               // what the fuck?
-	y = *(float*)&i;
+	memcpy(&y, &i, sizeof(y));
 	y = y * (threehalfs - (x2 * y * y));   // 1st iteration
 	y = y * ( threehalfs - ( x2 * y * y ) );   // 2nd iteration, this can be removed
 	
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "Common.h"
+
+// Sorting of the sphere store along a Z-order (Morton) curve
+// As the spheres move, spheres close in space end up far apart in the store, so the broadphase scans and the threads
+// moving consecutive ranges of spheres touch memory in a random order. Sorting a range of the store by the Morton key
+// of the positions makes spheres close in space close in memory again, and every thread gets a compact region of space
+
+// Bits of every coordinate in the key, so the key fits 32 bits
+#ifdef _3D
+constexpr uint32_t KMortonBits = 10;
+#else
+constexpr uint32_t KMortonBits = 16;
+#endif
+
+// Spreads the low KMortonBits bits of v so KMortonBits - 1 zero bits (one in 2D, two in 3D) are between every two of them
+inline uint32_t SpreadBits(uint32_t v)
+{
+#ifdef _3D
+	v &= 0x3ff;
+	v = (v | v << 16) & 0x030000ff;
+	v = (v | v << 8) & 0x0300f00f;
+	v = (v | v << 4) & 0x030c30c3;
+	v = (v | v << 2) & 0x09249249;
+#else
+	v &= 0xffff;
+	v = (v | v << 8) & 0x00ff00ff;
+	v = (v | v << 4) & 0x0f0f0f0f;
+	v = (v | v << 2) & 0x33333333;
+	v = (v | v << 1) & 0x55555555;
+#endif
+	return v;
+}
+
+// Coordinate quantised over the world, positions outside it are clamped to its edges
+inline uint32_t MortonCoordinate(float p)
+{
+	constexpr auto cells = static_cast<float>(1u << KMortonBits);
+	const auto c = (p + gSettings.mRangeSpawn) / (2.f * gSettings.mRangeSpawn) * cells;
+	return static_cast<uint32_t>(std::min(std::max(c, 0.f), cells - 1.f));
+}
+
+inline uint32_t MortonKey(uint32_t sphere)
+{
+	const auto& spheres = gSpheresCollisionInfo;
+	auto key = SpreadBits(MortonCoordinate(spheres.mPositionX[sphere])) | SpreadBits(MortonCoordinate(spheres.mPositionY[sphere])) << 1;
+#ifdef _3D
+	key |= SpreadBits(MortonCoordinate(spheres.mPositionZ[sphere])) << 2;
+#endif
+	return key;
+}
+
+// Sorts the spheres [first, last) of the store by Morton key, moving their data in gSpheres and their handles along and
+// renumbering them in the broadphase in use. The broadphases rebuilt every frame and the blocker BVH, built after the
+// blocking spheres are sorted, need nothing
+inline void ReorderSpheres(uint32_t first, uint32_t last)
+{
+	std::vector<std::pair<uint32_t, uint32_t>> keys(last - first);
+	for (auto i = first; i != last; ++i) keys[i - first] = { MortonKey(i), i };
+	std::sort(keys.begin(), keys.end());
+
+	std::vector<uint32_t> order(keys.size());
+	for (size_t k = 0; k < keys.size(); ++k) order[k] = keys[k].second;
+
+	gSpheresCollisionInfo.Permute(first, order);
+	SSphereStore::PermuteColumn(gSpheres, first, order);
+	for (auto i = first; i != last; ++i) gSphereHandles.Move(gSpheres[i].mHandle, i);
+
+	switch (gSettings.mBroadphase)
+	{
+	case EBroadphase::Grid:          gGrid->Renumber(first, order); break;
+	case EBroadphase::SweepAndPrune: gSweepAndPrune->Renumber(first, order); break;
+	case EBroadphase::AABBTree:      gAABBTree->Renumber(first, order); break;
+	case EBroadphase::LooseTree:     gLooseTree->Renumber(first, order); break;
+	default: break;
+	}
+}
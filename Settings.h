@@ -0,0 +1,280 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+//---------------------------------------------------------------
+// Run time settings
+// Set from the command line (--key value) or from a config file (key = value, one per line, # for comments)
+//---------------------------------------------------------------
+
+// Broad phase used to find the spheres each sphere can collide with
+enum class EBroadphase
+{
+	Grid,			// Grid updated incrementally as the spheres move between partitions
+	CompactGrid,	// Grid rebuilt every frame with a counting sort, see CompactGrid.h
+	HashGrid,		// Unbounded grid rebuilt every frame, only the occupied cells are stored, see HashGrid.h
+	SweepAndPrune,	// Spheres kept sorted on the x axis across frames, see SweepAndPrune.h
+	AABBTree,		// Dynamic tree of fat boxes, see AABBTree.h
+	LooseTree,		// Loose quadtree (octree in 3D) split where the spheres are crowded, see LooseTree.h
+};
+
+inline const char* BroadphaseName(EBroadphase broadphase)
+{
+	switch (broadphase)
+	{
+	case EBroadphase::Grid:          return "grid";
+	case EBroadphase::CompactGrid:   return "compact";
+	case EBroadphase::HashGrid:      return "hash";
+	case EBroadphase::SweepAndPrune: return "sap";
+	case EBroadphase::AABBTree:      return "tree";
+	case EBroadphase::LooseTree:     return "loose";
+	}
+	return "";
+}
+
+struct SSettings
+{
+	// Scene
+	uint32_t mNumSpheres = 10000;			// Total number of spheres, half of them moving
+	float    mRangeSpawn = 5000.f;			// The world spans [-mRangeSpawn, mRangeSpawn] on every axis
+	float    mRangeRadius = 2.f;			// Radius of the spheres is random in [0.5, mRangeRadius]
+	float    mRangeVelocity = 50.f;			// Every velocity component is random in [-mRangeVelocity, mRangeVelocity]
+	uint32_t mNumClusters = 0;				// Spheres are spawned around this many random centres, 0 means spread over the world
+	float    mClusterRadius = 250.f;		// Every position component is at most this far from the centre of its cluster
+
+	// Grid, set one of the two, the other is derived by ValidateSettings
+	uint32_t mNumPartitions = 20;			// Partitions per axis
+	float    mPartitionSize = 0.f;			// Size of a partition, 0 means derived from the number of partitions
+	EBroadphase mBroadphase = EBroadphase::Grid;
+	float    mHashCellSize = 0.f;			// Cell size of the hash grid, 0 means the collision range of the largest spheres
+	bool     mBlockerBVH = false;			// The blocking spheres are kept out of the broadphase and found with a BVH
+	uint32_t mReorderFrames = 0;			// The moving spheres are sorted in memory by Morton key every this many frames, 0 means never
+	bool     mContinuous = false;			// The spheres are swept over the frame and stopped at their first contact, see Continuous.h
+	bool     mRemoveDead = true;			// Spheres whose health reaches 0 are removed, otherwise they stay at 0 health
+
+	// Run
+	uint32_t mNumFrames = 1000;				// Number of frames simulated before exiting (headless only)
+	uint32_t mNumThreads = 0;				// Threads used by UpdateSpheres including the main one, 0 means hardware concurrency
+	uint32_t mSeed = 0;						// Seed for the scene generation, 0 means seeded by the current time
+	float    mTimeStep = 1.f / 60.f;		// Seconds simulated per physics step
+	uint32_t mMaxSteps = 4;					// Physics steps run at most per rendered frame, the time left is dropped (visualisation only)
+	bool     mPrintFrames = true;			// Print the time of every frame, not only the totals
+	bool     mPrintChecksum = false;		// Print a hash of the state of the spheres after the last frame (headless only)
+
+	// Collision log (_LOG builds only), see LogWriter.h
+	std::string mLogPath = "Collisions";	// Files are named mLogPath.0.bin, mLogPath.1.bin, ...
+	uint32_t mLogFileSize = 64;				// A new file is started once the current one is this many MB
+};
+
+
+inline void PrintUsage(const char* program)
+{
+	std::cout << "Usage: " << program << " [options]\n"
+		<< "  --config FILE     read the settings from FILE (key = value, keys as the options below)\n"
+		<< "  --spheres N       total number of spheres, half of them moving\n"
+		<< "  --range R         the world spans [-R, R] on every axis\n"
+		<< "  --radius R        maximum radius of the spheres\n"
+		<< "  --velocity V      maximum speed on every axis\n"
+		<< "  --clusters N      spawn the spheres around N random centres, 0 = spread over the world\n"
+		<< "  --cluster-radius R largest distance on every axis of a sphere from its cluster centre\n"
+		<< "  --partitions N    grid partitions per axis\n"
+		<< "  --cell-size S     grid partition size, overrides --partitions\n"
+		<< "  --broadphase B    grid (incremental), compact (rebuilt every frame), hash (unbounded, rebuilt every frame),\n"
+		<< "                    sap (sort and sweep), tree (dynamic AABB tree) or loose (loose quadtree/octree)\n"
+		<< "  --hash-cell-size S cell size of the hash grid, 0 = the collision range of the largest spheres\n"
+		<< "  --blocker-bvh 0|1 find the blocking spheres with a BVH built once, the broadphase only holds the moving ones\n"
+		<< "  --reorder N       sort the moving spheres in memory along a Morton curve every N frames, 0 = never\n"
+		<< "  --ccd 0|1         sweep the spheres over the frame and stop them at their first contact, so fast spheres\n"
+		<< "                    do not pass through small ones with large --dt\n"
+		<< "  --remove-dead 0|1 remove the spheres whose health reaches 0, 0 keeps the number of spheres constant\n"
+		<< "  --frames N        number of frames to simulate\n"
+		<< "  --threads N       threads used to update the spheres, 0 = hardware concurrency\n"
+		<< "  --seed N          seed for the scene generation, 0 = current time\n"
+		<< "  --dt S            seconds simulated per physics step, a rendered frame runs as many as the time it took\n"
+		<< "  --max-steps N     physics steps run at most per rendered frame, the time left behind is dropped\n"
+		<< "  --quiet           print only the aggregate timings\n"
+		<< "  --checksum        print a hash of the final state, the same for any number of threads\n"
+		<< "  --log PATH        collision log files PATH.0.bin, PATH.1.bin, ... (_LOG builds)\n"
+		<< "  --log-file-size N start a new collision log file every N MB\n";
+}
+
+// Returns false if the key is not a setting
+inline bool ParseSetting(const std::string& key, const std::string& value, SSettings& settings)
+{
+	const auto u = [&]() { return static_cast<uint32_t>(strtoul(value.c_str(), nullptr, 10)); };
+	const auto f = [&]() { return strtof(value.c_str(), nullptr); };
+
+	if      (key == "spheres")    settings.mNumSpheres = u();
+	else if (key == "range")      settings.mRangeSpawn = f();
+	else if (key == "radius")     settings.mRangeRadius = f();
+	else if (key == "velocity")   settings.mRangeVelocity = f();
+	else if (key == "clusters")   settings.mNumClusters = u();
+	else if (key == "cluster-radius") settings.mClusterRadius = f();
+	else if (key == "partitions") { settings.mNumPartitions = u(); settings.mPartitionSize = 0.f; }
+	else if (key == "cell-size")  settings.mPartitionSize = f();
+	else if (key == "hash-cell-size") settings.mHashCellSize = f();
+	else if (key == "broadphase")
+	{
+		if      (value == BroadphaseName(EBroadphase::Grid))          settings.mBroadphase = EBroadphase::Grid;
+		else if (value == BroadphaseName(EBroadphase::CompactGrid))   settings.mBroadphase = EBroadphase::CompactGrid;
+		else if (value == BroadphaseName(EBroadphase::HashGrid))      settings.mBroadphase = EBroadphase::HashGrid;
+		else if (value == BroadphaseName(EBroadphase::SweepAndPrune)) settings.mBroadphase = EBroadphase::SweepAndPrune;
+		else if (value == BroadphaseName(EBroadphase::AABBTree))      settings.mBroadphase = EBroadphase::AABBTree;
+		else if (value == BroadphaseName(EBroadphase::LooseTree))     settings.mBroadphase = EBroadphase::LooseTree;
+		else return false;
+	}
+	else if (key == "blocker-bvh") settings.mBlockerBVH = value == "1" || value == "true";
+	else if (key == "reorder")    settings.mReorderFrames = u();
+	else if (key == "ccd")        settings.mContinuous = value == "1" || value == "true";
+	else if (key == "remove-dead") settings.mRemoveDead = value == "1" || value == "true";
+	else if (key == "frames")     settings.mNumFrames = u();
+	else if (key == "threads")    settings.mNumThreads = u();
+	else if (key == "seed")       settings.mSeed = u();
+	else if (key == "dt")         settings.mTimeStep = f();
+	else if (key == "max-steps")  settings.mMaxSteps = u();
+	else if (key == "quiet")      settings.mPrintFrames = value == "0" || value == "false";
+	else if (key == "checksum")   settings.mPrintChecksum = value == "1" || value == "true";
+	else if (key == "log")        settings.mLogPath = value;
+	else if (key == "log-file-size") settings.mLogFileSize = u();
+	else return false;
+
+	return true;
+}
+
+inline bool LoadConfigFile(const std::string& fileName, SSettings& settings)
+{
+	std::ifstream file(fileName);
+	if (!file)
+	{
+		std::cerr << "Cannot open config file " << fileName << "\n";
+		return false;
+	}
+
+	const auto trim = [](const std::string& s)
+	{
+		const auto first = s.find_first_not_of(" \t\r");
+		const auto last = s.find_last_not_of(" \t\r");
+		return first == std::string::npos ? std::string() : s.substr(first, last - first + 1);
+	};
+
+	std::string line;
+	for (int lineNumber = 1; std::getline(file, line); ++lineNumber)
+	{
+		line = trim(line.substr(0, line.find('#')));
+		if (line.empty()) continue;
+
+		const auto equals = line.find('=');
+		if (equals == std::string::npos || !ParseSetting(trim(line.substr(0, equals)), trim(line.substr(equals + 1)), settings))
+		{
+			std::cerr << fileName << "(" << lineNumber << "): invalid setting \"" << line << "\"\n";
+			return false;
+		}
+	}
+	return true;
+}
+
+// Derives the grid partition size and checks the settings are consistent, returns false if they cannot be used
+inline bool ValidateSettings(SSettings& settings)
+{
+	if (settings.mRangeSpawn < 1.f || settings.mRangeRadius < 0.5f || settings.mRangeRadius >= settings.mRangeSpawn)
+	{
+		std::cerr << "The world range must be at least 1 and the maximum radius in [0.5, range)\n";
+		return false;
+	}
+
+	if (settings.mNumClusters > 0 && (settings.mClusterRadius <= 0.f || settings.mClusterRadius >= settings.mRangeSpawn))
+	{
+		std::cerr << "The cluster radius must be in (0, range)\n";
+		return false;
+	}
+
+	if (settings.mTimeStep <= 0.f || settings.mMaxSteps == 0)
+	{
+		std::cerr << "The time step must be positive and at least one step run per frame\n";
+		return false;
+	}
+
+	const auto worldSize = settings.mRangeSpawn * 2.f;
+	if (settings.mPartitionSize > 0.f)
+		settings.mNumPartitions = static_cast<uint32_t>(std::ceil(worldSize / settings.mPartitionSize));
+	if (settings.mNumPartitions == 0) settings.mNumPartitions = 1;
+	settings.mPartitionSize = worldSize / settings.mNumPartitions;
+
+	// A sphere is only tested against the spheres of its own and the neighbouring partitions, so a partition
+	// cannot be smaller than the largest distance two spheres collide at (their diameter times KCollisionRangeScale)
+	const auto collisionRange = 2.f * settings.mRangeRadius * KCollisionRangeScale;
+	if (settings.mPartitionSize < collisionRange)
+	{
+		std::cerr << "Partition size " << settings.mPartitionSize << " is smaller than the collision range of the largest spheres ("
+			<< collisionRange << "), use fewer partitions or a smaller radius\n";
+		return false;
+	}
+
+	// The hash grid also only tests the neighbouring cells, by default its cells are the smallest that allows it
+	if (settings.mHashCellSize == 0.f) settings.mHashCellSize = collisionRange;
+	if (settings.mHashCellSize < collisionRange)
+	{
+		std::cerr << "Hash cell size " << settings.mHashCellSize << " is smaller than the collision range of the largest spheres ("
+			<< collisionRange << ")\n";
+		return false;
+	}
+
+	if (settings.mNumThreads == 0) settings.mNumThreads = std::thread::hardware_concurrency();
+	if (settings.mNumThreads == 0) settings.mNumThreads = 8;
+	if (settings.mNumThreads > MAX_WORKERS + 1) settings.mNumThreads = MAX_WORKERS + 1;
+
+	return true;
+}
+
+// Returns false if the program should exit (bad arguments or help requested)
+inline bool ParseCommandLine(int argc, char** argv, SSettings& settings)
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		const std::string arg = argv[i];
+
+		if (arg == "--help" || arg == "-h")
+		{
+			PrintUsage(argv[0]);
+			return false;
+		}
+		if (arg == "--quiet")
+		{
+			settings.mPrintFrames = false;
+			continue;
+		}
+		if (arg == "--checksum")
+		{
+			settings.mPrintChecksum = true;
+			continue;
+		}
+
+		if (arg.compare(0, 2, "--") != 0 || i + 1 >= argc)
+		{
+			std::cerr << "Invalid option " << arg << "\n";
+			PrintUsage(argv[0]);
+			return false;
+		}
+
+		const auto key = arg.substr(2);
+		const std::string value = argv[++i];
+
+		if (key == "config")
+		{
+			if (!LoadConfigFile(value, settings)) return false;
+		}
+		else if (!ParseSetting(key, value, settings))
+		{
+			std::cerr << "Unknown option " << arg << "\n";
+			PrintUsage(argv[0]);
+			return false;
+		}
+	}
+
+	return ValidateSettings(settings);
+}
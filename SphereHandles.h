@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// Reference to a sphere that stays valid while the sphere is moved in the store, by ReorderSpheres or when other
+// spheres are removed, and is seen as stale once the sphere is destroyed, even after its slot is reused
+struct SSphereHandle
+{
+	uint32_t mSlot = ~0u;
+	uint32_t mGeneration = 0;
+};
+
+// Slots mapping the handles to the index of their sphere in the store
+// A slot is reused by a later sphere once its sphere is destroyed, with its generation incremented so the handles to
+// the destroyed sphere do not find the new one
+class SphereHandles
+{
+
+public:
+
+	void Clear()
+	{
+		mSlots.clear();
+		mFreeSlots.clear();
+	}
+
+	SSphereHandle Create(uint32_t sphere)
+	{
+		if (mFreeSlots.empty())
+		{
+			mSlots.push_back({ sphere, 0 });
+			return { static_cast<uint32_t>(mSlots.size()) - 1, 0 };
+		}
+
+		const auto slot = mFreeSlots.back();
+		mFreeSlots.pop_back();
+		mSlots[slot].mSphere = sphere;
+		return { slot, mSlots[slot].mGeneration };
+	}
+
+	void Destroy(const SSphereHandle& handle)
+	{
+		++mSlots[handle.mSlot].mGeneration;
+		mFreeSlots.push_back(handle.mSlot);
+	}
+
+	// Called when the sphere of the handle moved to a new index of the store
+	void Move(const SSphereHandle& handle, uint32_t sphere)
+	{
+		mSlots[handle.mSlot].mSphere = sphere;
+	}
+
+	// Returns false if the sphere was destroyed, otherwise its index in the store
+	bool Find(const SSphereHandle& handle, uint32_t& sphere) const
+	{
+		if (handle.mSlot >= mSlots.size() || mSlots[handle.mSlot].mGeneration != handle.mGeneration) return false;
+		sphere = mSlots[handle.mSlot].mSphere;
+		return true;
+	}
+
+private:
+
+	struct SSlot
+	{
+		uint32_t mSphere;
+		uint32_t mGeneration;
+	};
+
+	std::vector<SSlot> mSlots;
+	std::vector<uint32_t> mFreeSlots;
+};
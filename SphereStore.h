@@ -0,0 +1,238 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+// DOD approach
+// The collision state of every sphere is kept as a structure of arrays, so the hot loops only
+// pull through the cache the fields they read (e.g. the distance test only reads positions and radii)
+// The blocking spheres are stored first, followed by the moving spheres, the index of a sphere
+// in the store is also its index in the gSpheres array
+struct SSphereStore
+{
+	std::vector<float> mPositionX;
+	std::vector<float> mPositionY;
+#ifdef _3D
+	std::vector<float> mPositionZ;
+#endif
+
+	std::vector<float> mVelocityX;
+	std::vector<float> mVelocityY;
+#ifdef _3D
+	std::vector<float> mVelocityZ;
+#endif
+
+	std::vector<float> mRadius;
+
+	// Spatial partitioning helper code
+
+	std::vector<int> mPartition;		// index of the partition the sphere is in, -1 if not in the grid
+	std::vector<int> mIndexInPartition;	// position of the sphere inside its partition
+
+	// First contact of the frame in continuous mode, set by FindImpacts and consumed when the sphere moves
+
+	std::vector<int> mContact;			// index of the sphere collided with, -1 if none
+	std::vector<CVector> mContactNormal;
+	std::vector<float> mContactTime;	// fraction of the frame elapsed at the contact, only set in continuous mode
+
+	uint32_t mNumBlocking = 0;
+
+	// New index of a sphere removed by Compact
+	static constexpr uint32_t KRemoved = ~0u;
+
+	uint32_t Size() const { return static_cast<uint32_t>(mRadius.size()); }
+
+	uint32_t NumMoving() const { return Size() - mNumBlocking; }
+
+	bool IsBlocking(uint32_t i) const { return i < mNumBlocking; }
+
+	void Clear()
+	{
+		Resize(0);
+		mNumBlocking = 0;
+	}
+
+	void Reserve(uint32_t n)
+	{
+		mPositionX.reserve(n);
+		mPositionY.reserve(n);
+		mVelocityX.reserve(n);
+		mVelocityY.reserve(n);
+#ifdef _3D
+		mPositionZ.reserve(n);
+		mVelocityZ.reserve(n);
+#endif
+		mRadius.reserve(n);
+		mPartition.reserve(n);
+		mIndexInPartition.reserve(n);
+		mContact.reserve(n);
+		mContactNormal.reserve(n);
+		mContactTime.reserve(n);
+	}
+
+	void Resize(uint32_t n)
+	{
+		mPositionX.resize(n);
+		mPositionY.resize(n);
+		mVelocityX.resize(n);
+		mVelocityY.resize(n);
+#ifdef _3D
+		mPositionZ.resize(n);
+		mVelocityZ.resize(n);
+#endif
+		mRadius.resize(n);
+		mPartition.resize(n, -1);
+		mIndexInPartition.resize(n, -1);
+		mContact.resize(n, -1);
+		mContactNormal.resize(n);
+		mContactTime.resize(n, 1.f);
+	}
+
+	// Moves the spheres [first, first + order.size()) so the sphere at first + k is the one that was at order[k]
+	// The spheres are only moved within their range, order must be a permutation of the indices of the range
+	void Permute(uint32_t first, const std::vector<uint32_t>& order)
+	{
+		PermuteColumn(mPositionX, first, order);
+		PermuteColumn(mPositionY, first, order);
+		PermuteColumn(mVelocityX, first, order);
+		PermuteColumn(mVelocityY, first, order);
+#ifdef _3D
+		PermuteColumn(mPositionZ, first, order);
+		PermuteColumn(mVelocityZ, first, order);
+#endif
+		PermuteColumn(mRadius, first, order);
+		PermuteColumn(mPartition, first, order);
+		PermuteColumn(mIndexInPartition, first, order);
+		PermuteColumn(mContact, first, order);
+		PermuteColumn(mContactNormal, first, order);
+		PermuteColumn(mContactTime, first, order);
+	}
+
+	template<typename T>
+	static void PermuteColumn(std::vector<T>& column, uint32_t first, const std::vector<uint32_t>& order)
+	{
+		std::vector<T> permuted;
+		permuted.reserve(order.size());
+		for (const auto i : order) permuted.push_back(std::move(column[i]));
+		std::move(permuted.begin(), permuted.end(), column.begin() + first);
+	}
+
+	// New index of every sphere once the spheres are removed, KRemoved for the removed ones
+	// Every sphere is swap-removed: the last sphere of the same kind takes its place, and when it is a blocking sphere
+	// the last moving sphere then takes the place freed at the end of the blocking ones, so they stay first. Only the
+	// spheres at the end of the store move, the others keep their index
+	std::vector<uint32_t> SwapRemoveOrder(std::vector<uint32_t> removed) const
+	{
+		std::vector<uint32_t> sphereAt(Size());
+		for (uint32_t i = 0; i < Size(); ++i) sphereAt[i] = i;
+
+		// From the highest index, so the last spheres are never among the ones left to remove
+		std::sort(removed.begin(), removed.end(), std::greater<uint32_t>());
+		auto size = Size();
+		auto numBlocking = mNumBlocking;
+		for (auto i : removed)
+		{
+			if (i < numBlocking)
+			{
+				sphereAt[i] = sphereAt[--numBlocking];
+				i = numBlocking;
+			}
+			sphereAt[i] = sphereAt[--size];
+		}
+
+		std::vector<uint32_t> newIndex(Size(), KRemoved);
+		for (uint32_t i = 0; i < size; ++i) newIndex[sphereAt[i]] = i;
+		return newIndex;
+	}
+
+	// Moves every sphere to its new index and drops the removed ones, see SwapRemoveOrder
+	void Compact(const std::vector<uint32_t>& newIndex)
+	{
+		auto numBlocking = mNumBlocking;
+		for (uint32_t i = 0; i < mNumBlocking; ++i)
+		{
+			if (newIndex[i] == KRemoved) --numBlocking;
+		}
+
+		CompactColumn(mPositionX, newIndex);
+		CompactColumn(mPositionY, newIndex);
+		CompactColumn(mVelocityX, newIndex);
+		CompactColumn(mVelocityY, newIndex);
+#ifdef _3D
+		CompactColumn(mPositionZ, newIndex);
+		CompactColumn(mVelocityZ, newIndex);
+#endif
+		CompactColumn(mRadius, newIndex);
+		CompactColumn(mPartition, newIndex);
+		CompactColumn(mIndexInPartition, newIndex);
+		CompactColumn(mContact, newIndex);
+		CompactColumn(mContactNormal, newIndex);
+		CompactColumn(mContactTime, newIndex);
+
+		mNumBlocking = numBlocking;
+	}
+
+	// The spheres only move to lower indices, in increasing order every sphere moves to a place already left
+	template<typename T>
+	static void CompactColumn(std::vector<T>& column, const std::vector<uint32_t>& newIndex)
+	{
+		uint32_t size = 0;
+		for (uint32_t i = 0; i < newIndex.size(); ++i)
+		{
+			if (newIndex[i] == KRemoved) continue;
+			if (newIndex[i] != i) column[newIndex[i]] = std::move(column[i]);
+			++size;
+		}
+		column.resize(size);
+	}
+
+	// Blocking spheres must all be added before the moving ones, returns the index of the new sphere
+	uint32_t Add(const CVector& position, const CVector& velocity, float radius, bool blocking)
+	{
+		const auto i = Size();
+		Resize(i + 1);
+		SetPosition(i, position);
+		SetVelocity(i, velocity);
+		mRadius[i] = radius;
+		if (blocking) ++mNumBlocking;
+		return i;
+	}
+
+	CVector Position(uint32_t i) const
+	{
+#ifdef _3D
+		return CVector3(mPositionX[i], mPositionY[i], mPositionZ[i]);
+#else
+		return CVector2(mPositionX[i], mPositionY[i]);
+#endif
+	}
+
+	CVector Velocity(uint32_t i) const
+	{
+#ifdef _3D
+		return CVector3(mVelocityX[i], mVelocityY[i], mVelocityZ[i]);
+#else
+		return CVector2(mVelocityX[i], mVelocityY[i]);
+#endif
+	}
+
+	void SetPosition(uint32_t i, const CVector& p)
+	{
+		mPositionX[i] = p.x;
+		mPositionY[i] = p.y;
+#ifdef _3D
+		mPositionZ[i] = p.z;
+#endif
+	}
+
+	void SetVelocity(uint32_t i, const CVector& v)
+	{
+		mVelocityX[i] = v.x;
+		mVelocityY[i] = v.y;
+#ifdef _3D
+		mVelocityZ[i] = v.z;
+#endif
+	}
+};
@@ -0,0 +1,148 @@
+#pragma once
+
+#include "Common.h"
+
+// Sort and sweep broad phase on the x axis, as an alternative to the grids
+// Every sphere is the interval [x - r * KCollisionRangeScale, x + r * KCollisionRangeScale] on the x axis, two spheres
+// can only collide if their intervals overlap. The blocking and the moving spheres are kept in two lists sorted on the
+// start of their interval: the blocking list is sorted once, the moving one is kept sorted across frames by an
+// insertion sort, which is close to linear as the spheres only move a little every frame
+class SweepAndPrune
+{
+
+public:
+
+	// Intervals of a list of spheres, sorted on mMin
+	struct SEndpoints
+	{
+		std::vector<uint32_t> mSpheres;		// Index of the sphere in gSpheresCollisionInfo
+		std::vector<float> mMin;
+		std::vector<float> mMax;
+		float mMaxExtent = 0.f;				// Largest mMax - mMin of the list
+
+		uint32_t Size() const { return static_cast<uint32_t>(mSpheres.size()); }
+
+		// Fills the list with the spheres [first, last) of the store, sorted
+		void Build(uint32_t first, uint32_t last)
+		{
+			const auto& spheres = gSpheresCollisionInfo;
+
+			std::vector<uint32_t> order(last - first);
+			for (auto i = first; i != last; ++i) order[i - first] = i;
+			std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b)
+			{
+				return spheres.mPositionX[a] - spheres.mRadius[a] * KCollisionRangeScale < spheres.mPositionX[b] - spheres.mRadius[b] * KCollisionRangeScale;
+			});
+
+			mSpheres = std::move(order);
+			mMin.resize(mSpheres.size());
+			mMax.resize(mSpheres.size());
+			mMaxExtent = 0.f;
+			for (auto s : mSpheres) mMaxExtent = std::max(mMaxExtent, 2.f * spheres.mRadius[s] * KCollisionRangeScale);
+
+			Update();
+		}
+
+		// Reads the new positions of the spheres and sorts the list again
+		void Update()
+		{
+			const auto& spheres = gSpheresCollisionInfo;
+			const auto n = Size();
+
+			for (uint32_t k = 0; k < n; ++k)
+			{
+				const auto s = mSpheres[k];
+				const auto range = spheres.mRadius[s] * KCollisionRangeScale;
+				mMin[k] = spheres.mPositionX[s] - range;
+				mMax[k] = spheres.mPositionX[s] + range;
+			}
+
+			// Insertion sort, every sphere is only shifted past the few ones it overtook since the last frame
+			for (uint32_t k = 1; k < n; ++k)
+			{
+				const auto min = mMin[k];
+				if (mMin[k - 1] <= min) continue;
+
+				const auto max = mMax[k];
+				const auto sphere = mSpheres[k];
+				auto j = k;
+				for (; j > 0 && mMin[j - 1] > min; --j)
+				{
+					mMin[j] = mMin[j - 1];
+					mMax[j] = mMax[j - 1];
+					mSpheres[j] = mSpheres[j - 1];
+				}
+				mMin[j] = min;
+				mMax[j] = max;
+				mSpheres[j] = sphere;
+			}
+		}
+
+		// Drops the removed spheres and renames the others, see SSphereStore::SwapRemoveOrder. The list stays sorted
+		void Compact(const std::vector<uint32_t>& newIndex)
+		{
+			uint32_t n = 0;
+			for (uint32_t k = 0; k < Size(); ++k)
+			{
+				const auto s = newIndex[mSpheres[k]];
+				if (s == SSphereStore::KRemoved) continue;
+				mSpheres[n] = s;
+				mMin[n] = mMin[k];
+				mMax[n] = mMax[k];
+				++n;
+			}
+			mSpheres.resize(n);
+			mMin.resize(n);
+			mMax.resize(n);
+		}
+
+		// Position of the first interval that can overlap one starting at min: no interval before it reaches min
+		uint32_t FirstOverlapping(float min) const
+		{
+			return static_cast<uint32_t>(std::lower_bound(mMin.begin(), mMin.end(), min - mMaxExtent) - mMin.begin());
+		}
+	};
+
+	SEndpoints mBlocking;
+	SEndpoints mMoving;
+
+
+	// Sorts all the spheres of the store, the blocking list is left empty when the blocking spheres are in the BVH
+	void Build()
+	{
+		const auto& spheres = gSpheresCollisionInfo;
+		mBlocking.Build(gSettings.mBlockerBVH ? spheres.mNumBlocking : 0u, spheres.mNumBlocking);
+		mMoving.Build(spheres.mNumBlocking, spheres.Size());
+	}
+
+	// The blocking spheres never move, only the moving list is sorted again
+	void Update()
+	{
+		mMoving.Update();
+	}
+
+	// Renames the spheres [first, first + order.size()) after the store was permuted by SSphereStore::Permute, the
+	// lists stay sorted as the spheres did not move
+	void Renumber(uint32_t first, const std::vector<uint32_t>& order)
+	{
+		std::vector<uint32_t> newIndex(order.size());
+		for (uint32_t k = 0; k < order.size(); ++k) newIndex[order[k] - first] = first + k;
+
+		for (auto* list : { &mBlocking, &mMoving })
+		{
+			for (auto& s : list->mSpheres)
+			{
+				if (s >= first && s < first + order.size()) s = newIndex[s - first];
+			}
+		}
+	}
+
+	// Drops the spheres removed from the store and renames the others, see SSphereStore::SwapRemoveOrder
+	// A blocking sphere can only take the place of another blocking sphere, and a moving one of a moving one or of the
+	// last blocking sphere, which becomes a moving place once the blocking spheres are compacted
+	void Compact(const std::vector<uint32_t>& newIndex)
+	{
+		mBlocking.Compact(newIndex);
+		mMoving.Compact(newIndex);
+	}
+};
@@ -0,0 +1,311 @@
+#pragma once
+
+#include "Common.h"
+
+#include <atomic>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#include <immintrin.h>
+#endif
+
+// Hint to the core that this thread is spinning, so it yields its resources to the other hyperthread
+inline void CpuRelax()
+{
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+	_mm_pause();
+#else
+	std::this_thread::yield();
+#endif
+}
+
+// Work stealing pool running the ParallelFor of the frame
+// A range is cut into chunks, KChunksPerThread per thread, and every thread starts with a contiguous block of them in
+// its own deque. A thread runs the chunks of its block in order, then steals chunks from the far end of the blocks of
+// the other threads, so a thread whose region of the world is dense gets help instead of making all the others wait
+// The deques are Chase-Lev deques (Chase and Lev 2005, with the C11 memory orders of Le et al. 2013): the owner pushes
+// and pops at the bottom without locking, the thieves take from the top with a compare and swap
+// Starting and finishing a range is a frame barrier that spins then parks: a new range is published by incrementing
+// mGeneration, which the workers spin on for a while before sleeping on a condition variable, and every worker marks
+// the range done in its own cache line, which the calling thread spins on. With frames under a millisecond the
+// threads are woken and waited for without any system call; the condition variables are only used by threads that
+// waited long enough to be parked, and only notified when one of them is
+class TaskScheduler
+{
+
+public:
+
+	static constexpr uint32_t KChunksPerThread = 8;
+
+	// Spins of a thread waiting at the barrier before it parks, a few tens of microseconds
+	static constexpr uint32_t KSpinIterations = 4000;
+
+	// Ring size of a deque, a power of two larger than the largest block of chunks
+	static constexpr int64_t KDequeCapacity = 64;
+	static_assert((KDequeCapacity & (KDequeCapacity - 1)) == 0 && KDequeCapacity > KChunksPerThread + 1, "");
+
+	enum class ESteal
+	{
+		Stolen,
+		Empty,
+		Lost,		// Another thread took the chunk first, the deque may still hold some
+	};
+
+	// State of a worker written by the worker, alone in its cache line so the workers do not invalidate each other
+	struct alignas(64) SWorker
+	{
+		std::atomic<uint64_t> mDoneGeneration{ 0 };	// Last range the worker finished
+	};
+
+	// Deque of chunk indices, aligned so the deques of two threads never share a cache line
+	struct alignas(64) SDeque
+	{
+		std::atomic<int64_t>  mTop{ 0 };
+		std::atomic<int64_t>  mBottom{ 0 };
+		std::atomic<uint32_t> mChunks[KDequeCapacity];
+
+		// Only called while no thread uses the deque
+		void Reset()
+		{
+			mTop.store(0, std::memory_order_relaxed);
+			mBottom.store(0, std::memory_order_relaxed);
+		}
+
+		// Owner only
+		void Push(uint32_t chunk)
+		{
+			const auto b = mBottom.load(std::memory_order_relaxed);
+			mChunks[b & (KDequeCapacity - 1)].store(chunk, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+			mBottom.store(b + 1, std::memory_order_relaxed);
+		}
+
+		// Owner only, takes the chunk pushed last
+		bool Pop(uint32_t& chunk)
+		{
+			const auto b = mBottom.load(std::memory_order_relaxed) - 1;
+			mBottom.store(b, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			auto t = mTop.load(std::memory_order_relaxed);
+
+			if (t > b)
+			{
+				mBottom.store(b + 1, std::memory_order_relaxed);
+				return false;
+			}
+
+			chunk = mChunks[b & (KDequeCapacity - 1)].load(std::memory_order_relaxed);
+			if (t != b) return true;
+
+			// Last chunk, race the thieves for it
+			const auto won = mTop.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+			mBottom.store(b + 1, std::memory_order_relaxed);
+			return won;
+		}
+
+		// Any thread, takes the chunk pushed first
+		ESteal Steal(uint32_t& chunk)
+		{
+			auto t = mTop.load(std::memory_order_acquire);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			const auto b = mBottom.load(std::memory_order_acquire);
+			if (t >= b) return ESteal::Empty;
+
+			chunk = mChunks[t & (KDequeCapacity - 1)].load(std::memory_order_relaxed);
+			if (!mTop.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) return ESteal::Lost;
+			return ESteal::Stolen;
+		}
+	};
+
+
+	// Starts the worker threads, the thread calling ParallelFor is thread 0 and worker i is thread i + 1
+	void Start(uint32_t numWorkers)
+	{
+		mNumWorkers = std::min(numWorkers, MAX_WORKERS);
+		for (uint32_t i = 0; i < mNumWorkers; ++i) mThreads.emplace_back(&TaskScheduler::WorkerLoop, this, i + 1);
+	}
+
+	void Stop()
+	{
+		mQuit.store(true);
+		Publish();
+		for (auto& thread : mThreads) thread.join();
+		mThreads.clear();
+		mNumWorkers = 0;
+	}
+
+	uint32_t NumThreads() const { return mNumWorkers + 1; }
+
+	// Runs task on every chunk of [start, end) and returns once all of them are done
+	// With multithreading off the whole range is run on the calling thread as one chunk
+	void ParallelFor(uint32_t start, uint32_t end, WorkTask task)
+	{
+		if (!bUsingMultithreading || mNumWorkers == 0 || end <= start)
+		{
+			if (start < end) task(0, start, end);
+			return;
+		}
+
+		const auto numThreads = NumThreads();
+		mTask = task;
+		mStart = start;
+		mCount = end - start;
+		mNumChunks = std::min(mCount, numThreads * KChunksPerThread);
+
+		// The workers are all waiting for the next range, so the deques can be filled from this thread
+		// The block of every thread is pushed backwards, so its owner pops it in order
+		for (uint32_t thread = 0; thread < numThreads; ++thread)
+		{
+			auto& deque = mDeques[thread];
+			deque.Reset();
+			const auto first = mNumChunks * thread / numThreads;
+			const auto last = mNumChunks * (thread + 1) / numThreads;
+			for (auto chunk = last; chunk > first; --chunk) deque.Push(chunk - 1);
+		}
+
+		const auto generation = Publish();
+
+		RunChunks(0);
+
+		// The deques can only be filled again once no worker is looking into them
+		WaitForWorkers(generation);
+	}
+
+private:
+
+	// Spins until ready() returns true, or returns false after KSpinIterations
+	// The thread yields now and then, in case the thread it waits for runs on the same core
+	template<typename Ready>
+	static bool SpinUntil(Ready ready)
+	{
+		for (uint32_t spin = 0; spin < KSpinIterations; ++spin)
+		{
+			if (ready()) return true;
+			if (spin % 64 == 63)
+				std::this_thread::yield();
+			else
+				CpuRelax();
+		}
+		return ready();
+	}
+
+	// Starts the next range, waking the parked workers if any. Returns the generation of the range
+	// The increment and the load of mNumParked are sequentially consistent, as the worker's increment of mNumParked
+	// and load of mGeneration, so either the worker sees the new generation or this thread sees it parked
+	uint64_t Publish()
+	{
+		const auto generation = mGeneration.fetch_add(1) + 1;
+		if (mNumParked.load() > 0)
+		{
+			// Taking the lock waits for a worker between parking and sleeping, so the notification is not lost
+			{ std::lock_guard<std::mutex> l(mLock); }
+			mWorkReady.notify_all();
+		}
+		return generation;
+	}
+
+	void WaitForWorkers(uint64_t generation)
+	{
+		const auto done = [&]()
+		{
+			for (uint32_t i = 0; i < mNumWorkers; ++i)
+			{
+				if (mWorkers[i].mDoneGeneration.load() != generation) return false;
+			}
+			return true;
+		};
+
+		if (SpinUntil(done)) return;
+
+		std::unique_lock<std::mutex> l(mLock);
+		mMainParked.store(true);
+		mWorkDone.wait(l, [&]() { return done(); });
+		mMainParked.store(false);
+	}
+
+	void WorkerLoop(uint32_t thread)
+	{
+		auto& state = mWorkers[thread - 1];
+		uint64_t generation = 0;
+		while (true)
+		{
+			// Spin, then park until the next range
+			if (!SpinUntil([&]() { return mGeneration.load() != generation; }))
+			{
+				std::unique_lock<std::mutex> l(mLock);
+				mNumParked.fetch_add(1);
+				mWorkReady.wait(l, [&]() { return mGeneration.load() != generation; });
+				mNumParked.fetch_sub(1);
+			}
+
+			generation = mGeneration.load(std::memory_order_acquire);
+			if (mQuit.load()) return;
+
+			RunChunks(thread);
+
+			// Same ordering as Publish: either the calling thread sees the range done, or this thread sees it parked
+			state.mDoneGeneration.store(generation);
+			if (mMainParked.load())
+			{
+				{ std::lock_guard<std::mutex> l(mLock); }
+				mWorkDone.notify_one();
+			}
+		}
+	}
+
+	// Runs the chunks of the own deque, then steals from the others until all the deques are empty
+	// Chunks are only pushed before the threads start, so once every deque was seen empty there is nothing left to do
+	void RunChunks(uint32_t thread)
+	{
+		uint32_t chunk;
+		while (mDeques[thread].Pop(chunk)) RunChunk(thread, chunk);
+
+		const auto numThreads = NumThreads();
+		bool lost = true;
+		while (lost)
+		{
+			lost = false;
+			for (uint32_t i = 1; i < numThreads; ++i)
+			{
+				auto& victim = mDeques[(thread + i) % numThreads];
+				for (auto result = victim.Steal(chunk); result != ESteal::Empty; result = victim.Steal(chunk))
+				{
+					if (result == ESteal::Lost)
+					{
+						lost = true;
+						break;
+					}
+					RunChunk(thread, chunk);
+				}
+			}
+		}
+	}
+
+	void RunChunk(uint32_t thread, uint32_t chunk)
+	{
+		const auto start = mStart + static_cast<uint32_t>(static_cast<uint64_t>(mCount) * chunk / mNumChunks);
+		const auto end = mStart + static_cast<uint32_t>(static_cast<uint64_t>(mCount) * (chunk + 1) / mNumChunks);
+		mTask(thread, start, end);
+	}
+
+	uint32_t mNumWorkers = 0;
+	std::vector<std::thread> mThreads;
+	SWorker mWorkers[MAX_WORKERS];
+	SDeque mDeques[MAX_WORKERS + 1];
+
+	// Range of the current ParallelFor, written before the workers are woken up
+	WorkTask mTask = nullptr;
+	uint32_t mStart = 0;
+	uint32_t mCount = 0;
+	uint32_t mNumChunks = 0;
+
+	// Written by the calling thread, read by all the workers
+	alignas(64) std::atomic<uint64_t> mGeneration{ 0 };
+	std::atomic<bool> mQuit{ false };
+
+	// Only used by the threads that stopped spinning
+	alignas(64) std::atomic<uint32_t> mNumParked{ 0 };
+	std::atomic<bool> mMainParked{ false };
+	std::mutex mLock;
+	std::condition_variable mWorkReady;
+	std::condition_variable mWorkDone;
+};